@@ -0,0 +1,165 @@
+// Runs clang over a corpus with and without the plugin and reports, per
+// translation unit, the wall time, the peak RSS and the cost per function
+// that the plugin adds on top of a plain -fsyntax-only compile.
+
+#include "ComplexityResults.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <chrono>
+#include <optional>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+static cl::opt<std::string> CorpusDir(cl::Positional, cl::desc("<corpus directory>"), cl::Required);
+static cl::opt<std::string> ClangPath("clang", cl::desc("clang++ to benchmark with"), cl::value_desc("path"),
+                                      cl::Required);
+static cl::opt<std::string> PluginPath("plugin", cl::desc("Path to libCyclomaticComplexity.so"), cl::value_desc("path"),
+                                       cl::Required);
+static cl::list<std::string> PluginArgs("plugin-arg", cl::desc("Extra argument for the plugin, e.g. threads=4"),
+                                        cl::value_desc("arg"));
+static cl::opt<unsigned> Repetitions("repetitions", cl::desc("Runs per translation unit; the fastest counts"),
+                                     cl::init(3));
+
+namespace {
+
+struct Measurement {
+    double seconds;
+    uint64_t peakKilobytes;
+};
+
+struct Row {
+    std::string file;
+    size_t functions;
+    Measurement baseline;
+    Measurement plugin;
+};
+
+} // namespace
+
+static std::optional<Measurement> run(ArrayRef<StringRef> args) {
+    std::optional<Measurement> best;
+    for (unsigned i = 0; i < Repetitions; ++i) {
+        std::optional<sys::ProcessStatistics> statistics;
+        std::string error;
+        auto start = std::chrono::steady_clock::now();
+        int status = sys::ExecuteAndWait(args[0], args, /*Env=*/std::nullopt, /*Redirects=*/{}, /*SecondsToWait=*/0,
+                                         /*MemoryLimit=*/0, &error, /*ExecutionFailed=*/nullptr, &statistics);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (status != 0) {
+            errs() << "cyclomatic-bench: '" << args.back() << "' failed" << (error.empty() ? "" : ": ") << error << "\n";
+            return std::nullopt;
+        }
+        Measurement measurement{elapsed.count(), statistics ? statistics->PeakMemory : 0};
+        if (!best || measurement.seconds < best->seconds)
+            best = measurement;
+    }
+    return best;
+}
+
+static size_t countFunctions(StringRef shardDir) {
+    size_t functions = 0;
+    std::error_code ec;
+    for (sys::fs::directory_iterator it(shardDir, ec), end; it != end && !ec; it.increment(ec)) {
+        auto file = ComplexityResultsFile::open(it->path());
+        if (!file) {
+            consumeError(file.takeError());
+            continue;
+        }
+        for (const auto &unit : file->getUnits())
+            functions += unit.size();
+    }
+    return functions;
+}
+
+int main(int argc, char **argv) {
+    cl::ParseCommandLineOptions(argc, argv, "Benchmark the cyclomatic complexity plugin over a corpus\n");
+
+    std::vector<std::string> sources;
+    std::error_code ec;
+    for (sys::fs::directory_iterator it(CorpusDir, ec), end; it != end && !ec; it.increment(ec)) {
+        if (sys::path::extension(it->path()) == ".cpp")
+            sources.push_back(it->path());
+    }
+    if (ec || sources.empty()) {
+        errs() << "cyclomatic-bench: no translation units in '" << CorpusDir << "'\n";
+        return 1;
+    }
+    std::sort(sources.begin(), sources.end());
+
+    SmallString<128> shardDir;
+    if (std::error_code dirError = sys::fs::createUniqueDirectory("cyclomatic-bench", shardDir)) {
+        errs() << "cyclomatic-bench: cannot create a shard directory: " << dirError.message() << "\n";
+        return 1;
+    }
+    // Without a header index the plugin skips every header function.
+    SmallString<128> headerIndexDir;
+    if (std::error_code dirError = sys::fs::createUniqueDirectory("cyclomatic-bench-headers", headerIndexDir)) {
+        errs() << "cyclomatic-bench: cannot create a header index directory: " << dirError.message() << "\n";
+        return 1;
+    }
+
+    std::vector<std::string> pluginArgs = {"-fplugin=" + PluginPath,
+                                           "-fplugin-arg-cyclomatic-complexity-output-dir=" + shardDir.str().str(),
+                                           "-fplugin-arg-cyclomatic-complexity-header-index=" +
+                                               headerIndexDir.str().str(),
+                                           "-fplugin-arg-cyclomatic-complexity-format=binary",
+                                           "-fplugin-arg-cyclomatic-complexity-remarks=none"};
+    for (const auto &arg : PluginArgs)
+        pluginArgs.push_back("-fplugin-arg-cyclomatic-complexity-" + arg);
+
+    std::vector<Row> rows;
+    for (const auto &source : sources) {
+        std::vector<StringRef> baselineArgs = {ClangPath, "-std=c++17", "-fsyntax-only", source};
+        std::vector<StringRef> args = {ClangPath, "-std=c++17", "-fsyntax-only"};
+        args.insert(args.end(), pluginArgs.begin(), pluginArgs.end());
+        args.push_back(source);
+
+        auto baseline = run(baselineArgs);
+        auto plugin = run(args);
+        if (!baseline || !plugin)
+            return 1;
+
+        rows.push_back({source, countFunctions(shardDir), *baseline, *plugin});
+        // Each TU is counted from its own shard, and measures its headers
+        // as if it were the first to include them.
+        sys::fs::remove_directories(shardDir);
+        sys::fs::create_directories(shardDir);
+        sys::fs::remove_directories(headerIndexDir);
+        sys::fs::create_directories(headerIndexDir);
+    }
+    sys::fs::remove_directories(shardDir);
+    sys::fs::remove_directories(headerIndexDir);
+
+    // format() only takes scalars, so the header is padded by hand.
+    outs() << left_justify("translation unit", 32) << " " << right_justify("functions", 10) << " "
+           << right_justify("baseline s", 10) << " " << right_justify("plugin s", 10) << " "
+           << right_justify("us/function", 12) << " " << right_justify("peak RSS MB", 12) << "\n";
+    Row total{"total", 0, {0, 0}, {0, 0}};
+    auto printRow = [](const Row &row) {
+        double overhead = std::max(0.0, row.plugin.seconds - row.baseline.seconds);
+        double perFunction = row.functions ? overhead * 1e6 / row.functions : 0;
+        outs() << format("%-32s %10zu %10.3f %10.3f %12.2f %12.1f\n", sys::path::filename(row.file).str().c_str(),
+                         row.functions, row.baseline.seconds, row.plugin.seconds, perFunction,
+                         row.plugin.peakKilobytes / 1024.0);
+    };
+    for (const Row &row : rows) {
+        printRow(row);
+        total.functions += row.functions;
+        total.baseline.seconds += row.baseline.seconds;
+        total.plugin.seconds += row.plugin.seconds;
+        total.plugin.peakKilobytes = std::max(total.plugin.peakKilobytes, row.plugin.peakKilobytes);
+    }
+    printRow(total);
+    return 0;
+}
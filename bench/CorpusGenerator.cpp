@@ -0,0 +1,204 @@
+// Generates translation units of a controllable shape for benchmarking the
+// plugin. The output only depends on the options and the seed, so two runs
+// with the same command line measure the same code.
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <random>
+#include <string>
+
+using namespace llvm;
+
+static cl::opt<std::string> OutputDir("o", cl::desc("Directory the corpus is written to"), cl::value_desc("dir"),
+                                      cl::init("corpus"));
+static cl::opt<unsigned> TUs("tus", cl::desc("Number of translation units"), cl::init(8));
+static cl::opt<unsigned> Functions("functions", cl::desc("Functions per translation unit"), cl::init(1000));
+static cl::opt<unsigned> Depth("depth", cl::desc("Maximum nesting depth of control flow"), cl::init(4));
+static cl::opt<unsigned> Branches("branches", cl::desc("Branching statements per function"), cl::init(8));
+static cl::opt<unsigned> Templates("templates", cl::desc("Function templates per translation unit"), cl::init(10));
+static cl::opt<unsigned> FanOut("fan-out", cl::desc("Instantiations of every template"), cl::init(10));
+static cl::opt<unsigned> Headers("headers", cl::desc("Shared headers, each included by every translation unit"),
+                                 cl::init(4));
+static cl::opt<unsigned> HeaderFunctions("header-functions", cl::desc("Inline functions per header"), cl::init(50));
+static cl::opt<unsigned> Seed("seed", cl::desc("Random seed"), cl::init(1));
+
+namespace {
+
+class BodyGenerator {
+    std::mt19937 &random;
+    raw_ostream &out;
+    unsigned remaining;
+    unsigned variable = 0;
+
+    unsigned pick(unsigned bound) { return std::uniform_int_distribution<unsigned>(0, bound - 1)(random); }
+
+    void indent(unsigned depth) { out.indent(4 * (depth + 1)); }
+
+    std::string condition() {
+        std::string lhs = "x" + std::to_string(pick(4));
+        switch (pick(3)) {
+        case 0:
+            return lhs + " > " + std::to_string(pick(100));
+        case 1:
+            return lhs + " % " + std::to_string(pick(7) + 2) + " == 0 && acc < " + std::to_string(pick(1000));
+        default:
+            return lhs + " != acc || " + lhs + " < 0";
+        }
+    }
+
+    // Emits one branching statement, nesting further ones inside while the
+    // depth allows it.
+    void statement(unsigned depth) {
+        --remaining;
+        bool nest = depth + 1 < Depth && remaining > 0 && pick(2) == 0;
+        indent(depth);
+        bool isSwitch = false;
+        switch (pick(5)) {
+        case 0:
+            out << "if (" << condition() << ") {\n";
+            break;
+        case 1: {
+            std::string index = "i" + std::to_string(variable++);
+            out << "for (int " << index << " = 0; " << index << " < x" << pick(4) << "; ++" << index << ") {\n";
+            break;
+        }
+        case 2:
+            out << "while (acc > " << pick(1000) << " && " << condition() << ") {\n";
+            indent(depth + 1);
+            out << "acc /= 2;\n";
+            break;
+        case 3:
+            out << "switch (x" << pick(4) << " & 3) {\n";
+            for (unsigned label = 0; label < 3; ++label) {
+                indent(depth);
+                out << "case " << label << ":\n";
+                indent(depth + 1);
+                out << "acc += " << label + 1 << ";\n";
+                indent(depth + 1);
+                out << "break;\n";
+            }
+            indent(depth);
+            out << "default: {\n";
+            isSwitch = true;
+            break;
+        default:
+            out << "acc += (" << condition() << ") ? " << pick(10) << " : " << pick(10) << ";\n";
+            return;
+        }
+
+        indent(depth + 1);
+        out << "acc ^= x" << pick(4) << ";\n";
+        if (nest)
+            statement(depth + 1);
+        indent(depth);
+        out << "}\n";
+        if (isSwitch) {
+            indent(depth);
+            out << "}\n";
+        }
+    }
+
+public:
+    BodyGenerator(std::mt19937 &random, raw_ostream &out) : random(random), out(out), remaining(Branches) {}
+
+    void generate() {
+        out << "    int acc = x0;\n";
+        while (remaining > 0)
+            statement(0);
+        out << "    return acc;\n";
+    }
+};
+
+} // namespace
+
+static void writeFunction(std::mt19937 &random, raw_ostream &out, StringRef prefix, StringRef name) {
+    out << prefix << "int " << name << "(int x0, int x1, int x2, int x3) {\n";
+    BodyGenerator(random, out).generate();
+    out << "}\n\n";
+}
+
+static bool writeFile(StringRef path, function_ref<void(raw_ostream &)> contents) {
+    std::error_code ec;
+    raw_fd_ostream out(path, ec, sys::fs::OF_Text);
+    if (ec) {
+        errs() << "cyclomatic-corpus: cannot write '" << path << "': " << ec.message() << "\n";
+        return false;
+    }
+    contents(out);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    cl::ParseCommandLineOptions(argc, argv, "Generate a synthetic corpus for cyclomatic complexity benchmarks\n");
+
+    if (std::error_code ec = sys::fs::create_directories(OutputDir)) {
+        errs() << "cyclomatic-corpus: cannot create '" << OutputDir << "': " << ec.message() << "\n";
+        return 1;
+    }
+    SmallString<256> root(OutputDir);
+    sys::fs::make_absolute(root);
+    std::mt19937 random(Seed);
+
+    for (unsigned header = 0; header < Headers; ++header) {
+        SmallString<256> path(root);
+        sys::path::append(path, "header_" + std::to_string(header) + ".h");
+        bool written = writeFile(path, [&](raw_ostream &out) {
+            out << "#pragma once\n\n";
+            for (unsigned i = 0; i < HeaderFunctions; ++i)
+                writeFunction(random, out, "inline ", "header_" + std::to_string(header) + "_" + std::to_string(i));
+        });
+        if (!written)
+            return 1;
+    }
+
+    json::Array commands;
+    for (unsigned tu = 0; tu < TUs; ++tu) {
+        std::string name = "tu_" + std::to_string(tu);
+        SmallString<256> path(root);
+        sys::path::append(path, name + ".cpp");
+        bool written = writeFile(path, [&](raw_ostream &out) {
+            for (unsigned header = 0; header < Headers; ++header)
+                out << "#include \"header_" << header << ".h\"\n";
+            out << "\nnamespace " << name << " {\n\n";
+            for (unsigned i = 0; i < Functions; ++i)
+                writeFunction(random, out, "", "function_" + std::to_string(i));
+
+            // Every template is instantiated FanOut times with distinct types.
+            out << "template <int N> struct Tag { static constexpr int value = N; };\n\n";
+            for (unsigned i = 0; i < Templates; ++i) {
+                out << "template <typename T>\nint templated_" << i << "(int x0, int x1, int x2, int x3) {\n";
+                out << "    if constexpr (T::value % 2 == 0) {\n        x0 += T::value;\n    }\n";
+                BodyGenerator(random, out).generate();
+                out << "}\n\n";
+            }
+            out << "int instantiate() {\n    int acc = 0;\n";
+            for (unsigned i = 0; i < Templates; ++i) {
+                for (unsigned j = 0; j < FanOut; ++j)
+                    out << "    acc += templated_" << i << "<Tag<" << j << ">>(acc, 1, 2, 3);\n";
+            }
+            out << "    return acc;\n}\n\n} // namespace " << name << "\n";
+        });
+        if (!written)
+            return 1;
+
+        // json::Value only references a StringRef, and `path` does not
+        // outlive this iteration, so the strings are copied.
+        commands.push_back(json::Object{{"directory", std::string(root)},
+                                        {"file", std::string(path)},
+                                        {"arguments", json::Array{"clang++", "-std=c++17", "-c", std::string(path)}}});
+    }
+
+    // Lets cyclomatic-scan run over the corpus directly.
+    SmallString<256> database(root);
+    sys::path::append(database, "compile_commands.json");
+    if (!writeFile(database, [&](raw_ostream &out) { out << formatv("{0:2}", json::Value(std::move(commands))) << "\n"; }))
+        return 1;
+    return 0;
+}
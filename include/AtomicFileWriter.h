@@ -0,0 +1,33 @@
+#ifndef ATOMIC_FILE_WRITER_H
+#define ATOMIC_FILE_WRITER_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <memory>
+#include <optional>
+#include <string>
+
+// Writes a file in pieces. The pieces go to a temporary file next to the
+// destination, which is renamed into place by commit(), so readers never
+// observe a partial file. Without a commit the temporary is removed again.
+class AtomicFileWriter {
+    std::string path;
+    std::optional<llvm::sys::fs::TempFile> temp;
+    std::unique_ptr<llvm::raw_fd_ostream> out;
+
+public:
+    AtomicFileWriter() = default;
+    AtomicFileWriter(const AtomicFileWriter &) = delete;
+    AtomicFileWriter &operator=(const AtomicFileWriter &) = delete;
+    ~AtomicFileWriter();
+
+    llvm::Error open(llvm::StringRef path);
+    bool isOpen() const { return out != nullptr; }
+    llvm::raw_ostream &stream() { return *out; }
+    llvm::Error commit();
+};
+
+#endif // ATOMIC_FILE_WRITER_H
@@ -0,0 +1,31 @@
+#ifndef CHANGED_LINES_H
+#define CHANGED_LINES_H
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
+
+#include <utility>
+#include <vector>
+
+// The lines a change touches, per file. Read either from a unified diff,
+// where added lines and the lines around removed ones count, or from a list
+// of "<file>:<line>" and "<file>:<first>-<last>" lines. Paths are made
+// absolute against the root the change is relative to.
+class ChangedLines {
+    // Sorted and merged ranges of line numbers, both ends included.
+    llvm::StringMap<std::vector<std::pair<unsigned, unsigned>>> ranges;
+
+    void add(llvm::StringRef root, llvm::StringRef path, unsigned first, unsigned last);
+    void finalize();
+
+public:
+    static llvm::Expected<ChangedLines> parse(llvm::StringRef text, llvm::StringRef root);
+    static llvm::Expected<ChangedLines> load(llvm::StringRef path, llvm::StringRef root);
+
+    bool containsFile(llvm::StringRef path) const { return ranges.count(path); }
+    bool intersects(llvm::StringRef path, unsigned first, unsigned last) const;
+    std::vector<llvm::StringRef> getFiles() const;
+};
+
+#endif // CHANGED_LINES_H
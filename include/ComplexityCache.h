@@ -0,0 +1,53 @@
+#ifndef COMPLEXITY_CACHE_H
+#define COMPLEXITY_CACHE_H
+
+#include "CyclomaticComplexity.h"
+
+#include "clang/Basic/SourceManager.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "llvm/ADT/StringRef.h"
+
+#include <optional>
+#include <string>
+#include <vector>
+
+// Persistent on-disk cache of per-translation-unit results. An entry is keyed
+// by the hash of the cc1 command line (main file, flags and output) and the
+// compile directory, and records every file the TU read together with its
+// size, modification time and content hash. An entry is only replayed if all
+// of those files are unchanged, so a hit lets the caller skip parsing.
+class ComplexityCache {
+    std::string directory;
+    // Mixed into every key for options that change the results but are not
+    // part of the compiler command line, such as the output format.
+    std::string salt;
+
+    std::string getEntryPath(llvm::StringRef key) const;
+    // Writes the dependency lines of the TU.
+    static void writeDependencies(llvm::raw_ostream &out, const clang::SourceManager &sm);
+
+public:
+    ComplexityCache(std::string directory, std::string salt);
+
+    std::string getKey(clang::CompilerInstance &instance) const;
+
+    // Returns true and fills `results` and the header functions the TU
+    // claimed if the entry for `key` is still valid.
+    bool lookup(llvm::StringRef key, std::string &results, std::vector<std::string> &claims) const;
+
+    // Returns the files the TU read when its entry was written, whether or
+    // not they have changed since.
+    std::optional<std::vector<std::string>> getDependencies(clang::CompilerInstance &instance) const;
+
+    // Passes cached results for the TU `instance` is compiling to `handler`,
+    // after making the header claims they depend on in `headerIndex`.
+    // Returns false if the TU has to be analyzed.
+    bool replay(clang::CompilerInstance &instance, llvm::StringRef mainFile, const ComplexityResultHandler &handler,
+                HeaderIndex *headerIndex) const;
+    // Wraps `handler` so that fresh results are stored as they are handled.
+    // The header index of `options` is wrapped too, to record the claims of
+    // the TU for replay; the options must be the ones the TU is analyzed with.
+    ComplexityResultHandler storeResults(ComplexityResultHandler handler, CyclomaticComplexityOptions &options) const;
+};
+
+#endif // COMPLEXITY_CACHE_H
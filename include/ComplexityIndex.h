@@ -0,0 +1,144 @@
+#ifndef COMPLEXITY_INDEX_H
+#define COMPLEXITY_INDEX_H
+
+#include "ComplexityResults.h"
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Index layout, version 1. It holds every function of a build together with
+// what dashboards ask for, precomputed, so queries are lookups in a mapped
+// file instead of a pass over all results:
+//   IndexHeader
+//   IndexSource[sourceCount]        the shards, with what they held
+//   BinaryResultsRecord[functionCount], grouped by source
+//   u32[ComplexityMetricCount][functionCount]     functions by descending score
+//   u32[ComplexityMetricCount][histogramBuckets]  functions per score; the
+//                                                 last bucket holds all above
+//   IndexDirectory[directoryCount]  sorted by path, including subdirectories
+//   string table
+// All integers are little endian and strings are (offset, length) pairs into
+// the string table.
+struct IndexHeader {
+    static constexpr char Magic[4] = {'C', 'Y', 'C', 'I'};
+    static constexpr uint32_t Version = 1;
+
+    char magic[4];
+    llvm::support::ulittle32_t version;
+    llvm::support::ulittle32_t sourceCount;
+    llvm::support::ulittle32_t functionCount;
+    llvm::support::ulittle32_t histogramBuckets;
+    llvm::support::ulittle32_t directoryCount;
+    llvm::support::ulittle32_t stringsSize;
+    llvm::support::ulittle32_t reserved;
+};
+
+// A shard is identified by its path, size and modification time, so an
+// update only has to read the shards that changed.
+struct IndexSource {
+    llvm::support::ulittle32_t pathOffset;
+    llvm::support::ulittle32_t pathLength;
+    llvm::support::ulittle64_t size;
+    llvm::support::little64_t mtime;
+    llvm::support::ulittle32_t firstFunction;
+    llvm::support::ulittle32_t functionCount;
+};
+
+// "" is the whole build; every other entry is a directory some function's
+// file is in, directly or below it.
+struct IndexDirectory {
+    llvm::support::ulittle32_t pathOffset;
+    llvm::support::ulittle32_t pathLength;
+    llvm::support::ulittle32_t functionCount;
+    llvm::support::ulittle32_t maxScores[ComplexityMetricCount];
+    llvm::support::ulittle64_t totalScores[ComplexityMetricCount];
+};
+
+static_assert(sizeof(IndexHeader) == 32, "index header must not be padded");
+static_assert(sizeof(IndexSource) == 32, "index source must not be padded");
+static_assert(sizeof(IndexDirectory) == 48, "index directory must not be padded");
+
+constexpr unsigned IndexHistogramBuckets = 64;
+
+// The functions of one shard, and how to recognize the shard again.
+struct IndexSourceInput {
+    std::string path;
+    uint64_t size;
+    int64_t mtime;
+    std::vector<FunctionResult> functions;
+};
+
+// Returns `path` without "." or ".." components and without a trailing
+// separator, as the index stores file and directory paths.
+std::string normalizeIndexPath(llvm::StringRef path);
+
+// Serializes an index over `sources`. It is assembled in memory and written
+// with a single call.
+void writeComplexityIndex(llvm::raw_ostream &out, llvm::ArrayRef<IndexSourceInput> sources);
+
+// Reader for an index. Like ComplexityResultsFile, the file is mapped and
+// validated once; accessors return views into the mapping.
+class ComplexityIndex {
+    std::unique_ptr<llvm::MemoryBuffer> buffer;
+    const IndexHeader *header = nullptr;
+    const IndexSource *sources = nullptr;
+    const BinaryResultsRecord *functions = nullptr;
+    const llvm::support::ulittle32_t *rankings = nullptr;
+    const llvm::support::ulittle32_t *histograms = nullptr;
+    const IndexDirectory *directories = nullptr;
+    llvm::StringRef strings;
+
+    explicit ComplexityIndex(std::unique_ptr<llvm::MemoryBuffer> buffer) : buffer(std::move(buffer)) {}
+    llvm::StringRef getString(uint32_t offset, uint32_t length) const { return strings.substr(offset, length); }
+
+public:
+    struct Source {
+        llvm::StringRef path;
+        uint64_t size;
+        int64_t mtime;
+        size_t firstFunction;
+        size_t functionCount;
+    };
+
+    struct Directory {
+        llvm::StringRef path;
+        unsigned functionCount;
+        ComplexityScores maxScores;
+        uint64_t totalScores[ComplexityMetricCount];
+    };
+
+    static llvm::Expected<ComplexityIndex> open(llvm::StringRef path);
+    static llvm::Expected<ComplexityIndex> create(std::unique_ptr<llvm::MemoryBuffer> buffer);
+
+    size_t size() const { return header->functionCount; }
+    FunctionResult getFunction(size_t index) const;
+
+    size_t getSourceCount() const { return header->sourceCount; }
+    Source getSource(size_t index) const;
+
+    // Indices of all functions, the highest `metric` first.
+    llvm::ArrayRef<llvm::support::ulittle32_t> getRanking(ComplexityMetric metric) const {
+        return llvm::ArrayRef(rankings + static_cast<unsigned>(metric) * size(), size());
+    }
+    // Number of functions per value of `metric`.
+    llvm::ArrayRef<llvm::support::ulittle32_t> getHistogram(ComplexityMetric metric) const {
+        unsigned buckets = header->histogramBuckets;
+        return llvm::ArrayRef(histograms + static_cast<unsigned>(metric) * buckets, buckets);
+    }
+
+    size_t getDirectoryCount() const { return header->directoryCount; }
+    Directory getDirectory(size_t index) const;
+    std::optional<Directory> findDirectory(llvm::StringRef path) const;
+};
+
+#endif // COMPLEXITY_INDEX_H
@@ -0,0 +1,143 @@
+#ifndef COMPLEXITY_RESULTS_H
+#define COMPLEXITY_RESULTS_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+enum class ResultsFormat { Text, Binary };
+
+// Every metric is computed in the same walk over a function body.
+// - McCabe: 1 + if, loops, case labels, catch handlers and ?: operators.
+// - ExtendedMcCabe: McCabe + every && and ||.
+// - Cognitive: SonarSource cognitive complexity; structures are weighted by
+//   how deeply they are nested, and goto and operator sequences count too.
+enum class ComplexityMetric : unsigned { McCabe, ExtendedMcCabe, Cognitive };
+constexpr unsigned ComplexityMetricCount = 3;
+
+// The name used for a metric in remarks and reports.
+llvm::StringRef getMetricName(ComplexityMetric metric);
+
+struct ComplexityScores {
+    unsigned values[ComplexityMetricCount] = {};
+
+    unsigned &operator[](ComplexityMetric metric) { return values[static_cast<unsigned>(metric)]; }
+    unsigned operator[](ComplexityMetric metric) const { return values[static_cast<unsigned>(metric)]; }
+};
+
+// The measurements of one function.
+struct FunctionResult {
+    llvm::StringRef name; // qualified name
+    llvm::StringRef file;
+    unsigned line;
+    ComplexityScores scores;
+};
+
+// Binary results layout, version 3. A file holds one or more units back to
+// back, so shards can be merged by plain concatenation. Each unit is a
+// header, `recordCount` fixed-width records and a string table. All integers
+// are little endian and every string is an (offset, length) pair into the
+// unit's string table.
+//
+// A unit is one chunk of a translation unit. Its key identifies the
+// compilation (see getTranslationUnitKey), so chunks of one TU can be put
+// back together while two compilations of the same main file stay apart.
+struct BinaryResultsHeader {
+    static constexpr char Magic[4] = {'C', 'Y', 'C', 'B'};
+    static constexpr uint32_t Version = 3;
+
+    char magic[4];
+    llvm::support::ulittle32_t version;
+    llvm::support::ulittle32_t size; // of the whole unit, header included
+    llvm::support::ulittle32_t recordCount;
+    llvm::support::ulittle32_t mainFileOffset;
+    llvm::support::ulittle32_t mainFileLength;
+    llvm::support::ulittle32_t keyOffset;
+    llvm::support::ulittle32_t keyLength;
+};
+
+struct BinaryResultsRecord {
+    llvm::support::ulittle32_t nameOffset;
+    llvm::support::ulittle32_t nameLength;
+    llvm::support::ulittle32_t fileOffset;
+    llvm::support::ulittle32_t fileLength;
+    llvm::support::ulittle32_t line;
+    llvm::support::ulittle32_t scores[ComplexityMetricCount]; // indexed by ComplexityMetric
+};
+
+static_assert(sizeof(BinaryResultsHeader) == 32, "binary results header must not be padded");
+static_assert(sizeof(BinaryResultsRecord) == 32, "binary results record must not be padded");
+
+// Serializes one unit. The unit is assembled in memory and written with a
+// single call.
+void writeBinaryResults(llvm::raw_ostream &out, llvm::StringRef mainFile, llvm::StringRef key,
+                        llvm::ArrayRef<FunctionResult> results);
+
+// A view of one translation unit inside a mapped results file. Nothing is
+// copied; the strings point into the mapping.
+class ComplexityResultsUnit {
+    const BinaryResultsHeader *header;
+    const BinaryResultsRecord *records;
+    llvm::StringRef strings;
+
+    friend class ComplexityResultsFile;
+    ComplexityResultsUnit(const BinaryResultsHeader *header, const BinaryResultsRecord *records, llvm::StringRef strings)
+        : header(header), records(records), strings(strings) {}
+
+public:
+    llvm::StringRef getMainFile() const { return strings.substr(header->mainFileOffset, header->mainFileLength); }
+    llvm::StringRef getKey() const { return strings.substr(header->keyOffset, header->keyLength); }
+    size_t size() const { return header->recordCount; }
+
+    FunctionResult operator[](size_t index) const {
+        const BinaryResultsRecord &record = records[index];
+        FunctionResult result{strings.substr(record.nameOffset, record.nameLength),
+                              strings.substr(record.fileOffset, record.fileLength), record.line, {}};
+        for (unsigned metric = 0; metric < ComplexityMetricCount; ++metric)
+            result.scores.values[metric] = record.scores[metric];
+        return result;
+    }
+};
+
+// Reader for binary results. The file is memory mapped and validated once
+// when it is opened, so queries afterwards are plain loads.
+class ComplexityResultsFile {
+    std::unique_ptr<llvm::MemoryBuffer> buffer;
+    std::vector<ComplexityResultsUnit> units;
+
+    explicit ComplexityResultsFile(std::unique_ptr<llvm::MemoryBuffer> buffer) : buffer(std::move(buffer)) {}
+
+public:
+    static llvm::Expected<ComplexityResultsFile> open(llvm::StringRef path);
+    static llvm::Expected<ComplexityResultsFile> create(std::unique_ptr<llvm::MemoryBuffer> buffer);
+
+    llvm::ArrayRef<ComplexityResultsUnit> getUnits() const { return units; }
+};
+
+// Prints a unit in the text format of results.cy: a "# TU: <main file>"
+// line, a "# Unit: <key>" line unless the key is the main file, and one
+// "Function: " line per result.
+void printResults(llvm::raw_ostream &out, const ComplexityResultsUnit &unit);
+void printResults(llvm::raw_ostream &out, llvm::StringRef mainFile, llvm::StringRef key,
+                  llvm::ArrayRef<FunctionResult> results);
+
+// The results of one unit, taken out of a text or binary report. The
+// strings point into the report.
+struct ParsedResultsUnit {
+    llvm::StringRef mainFile;
+    llvm::StringRef key;
+    std::vector<FunctionResult> results;
+};
+
+// Reads back what printResults wrote, so text shards can be regrouped like
+// binary ones.
+llvm::Expected<std::vector<ParsedResultsUnit>> parseTextResults(llvm::StringRef text);
+
+#endif // COMPLEXITY_RESULTS_H
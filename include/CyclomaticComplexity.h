@@ -1,39 +1,322 @@
 #ifndef CYCLOMATIC_COMPLEXITY_H
 #define CYCLOMATIC_COMPLEXITY_H
 
+#include "ChangedLines.h"
+#include "ComplexityResults.h"
+#include "FunctionScoreCache.h"
+#include "HeaderIndex.h"
+
 #include "clang/AST/ASTConsumer.h"
 #include "clang/AST/RecursiveASTVisitor.h"
+#include "clang/Analysis/CFG.h"
 #include "clang/Frontend/CompilerInstance.h"
-#include "clang/Frontend/FrontendAction.h"
-#include "clang/Tooling/Tooling.h"
+#include "clang/Basic/SourceLocation.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/GlobPattern.h"
+#include "llvm/Support/StringSaver.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/raw_ostream.h"
 
-#include <map>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
 #include <string>
+#include <vector>
 
-class CyclomaticComplexityVisitor : public clang::RecursiveASTVisitor<CyclomaticComplexityVisitor> {
-private:
-    clang::ASTContext *Context;
-    std::map<std::string, int> ComplexityMap;
+struct CyclomaticComplexityOptions {
+    // Functions defined in non-system headers are measured by the first
+    // translation unit to claim them here. Without an index they are skipped.
+    std::shared_ptr<HeaderIndex> headerIndex;
+    // Identifies the translation unit as the owner of its claims in
+    // headerIndex and in every results chunk it writes. Set by the consumer
+    // from getTranslationUnitKey; the main file is used when it is empty.
+    std::string unitKey;
 
-public:
-    explicit CyclomaticComplexityVisitor(clang::ASTContext *Context);
-    bool VisitFunctionDecl(clang::FunctionDecl *FD);
-    int countBranchingStatements(clang::Stmt *S);
-    void printComplexity();
+    // A file is measured if it matches one of includeGlobs (or there are
+    // none) and none of excludeGlobs. System headers are never measured.
+    std::vector<llvm::GlobPattern> includeGlobs;
+    std::vector<llvm::GlobPattern> excludeGlobs;
+
+    ResultsFormat format = ResultsFormat::Text;
+
+    // Remarks are meant for interactive use; the structured output always has
+    // every function. Summary mode emits a single remark per TU.
+    enum class RemarkMode { All, Summary, None };
+    RemarkMode remarks = RemarkMode::All;
+    // The metric that remarks report and the threshold applies to.
+    ComplexityMetric metric = ComplexityMetric::McCabe;
+    // Functions at or below this complexity get no remark and are not
+    // counted as above the threshold in the summary.
+    unsigned remarkThreshold = 0;
+
+    // Also measure template instantiations. Arms discarded by `if constexpr`
+    // do not count, and instantiations of one pattern that keep the same
+    // arms are only walked once.
+    bool templateInstantiations = false;
+
+    // Functions whose McCabe complexity from the AST walk is above this get
+    // their exact value from a control flow graph instead, E - N + 2. Unset
+    // means no graphs are built.
+    std::optional<unsigned> cfgThreshold;
+
+    // Worker threads for walking function bodies (0 = all cores). With more
+    // than one, the traversal only queues bodies; the walks then run on a
+    // thread pool. Everything that touches the SourceManager, Sema-side
+    // caches or the diagnostics engine stays on the calling thread.
+    unsigned threads = 1;
+
+    // Results are handed on in chunks of at most this many functions while
+    // the TU is traversed, so memory for them does not grow with the TU.
+    unsigned chunkRecords = 4096;
+
+    // Measure functions as the parser produces them rather than after the
+    // whole TU, while their bodies are still in cache. What the parser does
+    // not hand over is picked up at the end.
+    bool incremental = false;
+
+    // Scores from earlier analyses of the same code. Functions whose body is
+    // unchanged since then are not measured again.
+    std::shared_ptr<FunctionScoreCache> scoreCache;
+
+    // Functions whose `metric` is above the limit for their file are reported
+    // as errors. The limit of a file comes from the last rule whose glob
+    // matches it; a rule without a glob matches every file.
+    struct GateRule {
+        std::optional<llvm::GlobPattern> glob;
+        unsigned limit;
+    };
+    std::vector<GateRule> gates;
+
+    // Only functions overlapping these lines are measured; files without
+    // changes are pruned as a whole.
+    std::shared_ptr<const ChangedLines> changedLines;
+
+    bool isIncluded(llvm::StringRef path) const;
+    std::optional<unsigned> getGateLimit(llvm::StringRef path) const;
+    // Parses "<limit>" or "<glob>:<limit>".
+    static llvm::Expected<GateRule> parseGateRule(llvm::StringRef spec);
+};
+
+// Coarse kinds of statements, for counting what the walks see. Operator and
+// Operand are the expressions Halstead-style metrics are made of.
+enum class StatementKind : unsigned {
+    Branch,      // if, switch, ?:
+    Loop,        // for, range-based for, while, do
+    Case,        // case and default labels
+    Jump,        // goto, break, continue, throw
+    Return,      // return, co_return
+    Call,        // calls, constructions, message sends
+    Operator,    // unary, binary and compound assignment operators
+    Operand,     // references to declarations, members and literals
+    Declaration, // declaration statements
+    Other,
+};
+constexpr unsigned StatementKindCount = 10;
+
+llvm::StringRef getStatementKindName(StatementKind kind);
+
+// Statements walked per kind. The counts are one flat array, so adding up
+// the histograms of several walks is a single loop.
+struct StatementHistogram {
+    uint64_t counts[StatementKindCount] = {};
+
+    uint64_t &operator[](StatementKind kind) { return counts[static_cast<unsigned>(kind)]; }
+    uint64_t operator[](StatementKind kind) const { return counts[static_cast<unsigned>(kind)]; }
+
+    StatementHistogram &operator+=(const StatementHistogram &other) {
+        for (unsigned kind = 0; kind < StatementKindCount; ++kind)
+            counts[kind] += other.counts[kind];
+        return *this;
+    }
+
+    uint64_t total() const {
+        uint64_t sum = 0;
+        for (uint64_t count : counts)
+            sum += count;
+        return sum;
+    }
+};
+
+// Reported in -ftime-trace output at the end of every translation unit.
+struct ComplexityCounters {
+    uint64_t functionsVisited = 0;
+    uint64_t headerFunctionsSkipped = 0; // claimed by another TU
+    uint64_t functionsReused = 0;        // unchanged since the scoreCache entry
+    uint64_t gateViolations = 0;
+    StatementHistogram statements;    // walked
+    uint64_t bytesWritten = 0;
 };
 
-class CyclomaticComplexityASTConsumer : public clang::ASTConsumer {
+// Timers shown by -ftime-report. They only exist when clang's own do.
+struct ComplexityTimers {
+    llvm::TimerGroup group{"cyclomatic-complexity", "Cyclomatic complexity"};
+    llvm::Timer traversal{"traversal", "Traversal", group};
+    llvm::Timer metrics{"metrics", "Metric computation", group};
+    llvm::Timer output{"output", "Writing results", group};
+};
+
+// Receives the rendered results of a translation unit chunk by chunk. Every
+// chunk is a complete unit of the output format; `last` marks the final one.
+using ResultChunkHandler = std::function<void(llvm::StringRef mainFile, llvm::StringRef chunk, bool last)>;
+
+class CyclomaticComplexityVisitor : public clang::RecursiveASTVisitor<CyclomaticComplexityVisitor> {
 private:
-    CyclomaticComplexityVisitor Visitor;
+    clang::ASTContext *context;
+    clang::DiagnosticsEngine &d;
+    const CyclomaticComplexityOptions &options;
+    unsigned int remarkID;
+    unsigned int summaryID;
+    unsigned int gateID;
+    llvm::Timer *metricsTimer;
+    ComplexityCounters counters;
+
+    // Aggregates for the summary remark.
+    unsigned functionsMeasured = 0;
+    unsigned functionsAboveThreshold = 0;
+    unsigned maxComplexity = 0;
+    std::string maxComplexityName;
+
+    // The functions measured since the last chunk, in traversal order.
+    // Overloads and same-named functions in different scopes or files stay
+    // distinct. The strings are released with every chunk.
+    std::vector<FunctionResult> records;
+    llvm::BumpPtrAllocator arena;
+    std::optional<llvm::UniqueStringSaver> strings;
+    ResultChunkHandler output;
+
+    enum class FileClass { Source, Header, Excluded };
+    llvm::DenseMap<clang::FileID, FileClass> fileClasses;
+    // Absolute paths functions are recorded under, computed once per file.
+    llvm::DenseMap<clang::FileID, std::string> recordedPaths;
+
+    // The && or || sequence an expression is an operand of. A sequence of
+    // like operators adds to the cognitive complexity once.
+    enum class LogicalSequence : uint8_t { None, And, Or };
+
+    struct WorkItem {
+        const clang::Stmt *stmt;
+        unsigned nesting; // cognitive nesting level
+        LogicalSequence sequence = LogicalSequence::None;
+        bool elseIf = false;
+    };
+
+    struct WalkState {
+        // Work stack for walking function bodies. Its storage is reused from
+        // one function to the next, and because the walk is iterative the
+        // depth of the AST is bounded only by memory.
+        llvm::SmallVector<WorkItem, 256> workStack;
+        // Local classes, lambda classes and blocks found while walking a
+        // body. They are measured on their own once the walk of the
+        // enclosing body has finished.
+        llvm::SmallVector<clang::Decl *, 8> nestedDecls;
+        StatementHistogram statements;
+    };
+    // Used by the traversal itself; every worker thread has its own.
+    WalkState walk;
+
+    // Function bodies waiting for a worker when options.threads > 1.
+    // Identifies a body in options.scoreCache.
+    struct ScoreKey {
+        std::string usr;
+        uint64_t bodyHash;
+    };
+
+    struct PendingFunction {
+        clang::Decl *decl;
+        const clang::Stmt *body;
+        ComplexityScores scores;
+        std::vector<clang::Decl *> nestedDecls;
+        std::optional<ScoreKey> scoreKey;
+    };
+    std::vector<PendingFunction> pending;
+
+    // Functions already seen, only kept in incremental mode.
+    llvm::DenseSet<const clang::Decl *> measured;
+
+    // Complexity of instantiations, keyed by their shape followed by the
+    // address of their pattern.
+    llvm::StringMap<ComplexityScores> instantiationComplexity;
+
+    // Configured once and used for every graph of the translation unit.
+    clang::CFG::BuildOptions cfgOptions;
+
+    FileClass classifyLocation(clang::SourceLocation loc);
+    FileClass classifyFile(clang::FileID fileID);
+    bool shouldSkip(clang::Decl *decl);
+    bool isChanged(const clang::Decl *decl);
+    std::string getDeclIdentity(const clang::Decl *decl);
+    llvm::StringRef getRecordedPath(clang::SourceLocation loc);
+    void reportComplexity(clang::Decl *decl, const ComplexityScores &scores);
+    ComplexityScores calculateComplexity(const clang::Stmt *body, bool instantiated, WalkState &state);
+    ComplexityScores calculateInstantiationComplexity(clang::FunctionDecl *func);
+    std::optional<unsigned> calculateGraphComplexity(const clang::Decl *decl, const clang::Stmt *body);
+    bool getConstexprArm(const clang::IfStmt *ifStmt, const clang::Stmt *&arm);
+    bool collectInstantiationShape(const clang::Stmt *body, std::string &shape);
+    void recordComplexity(clang::Decl *decl, const ComplexityScores &scores);
+    std::optional<ScoreKey> getScoreKey(const clang::Decl *decl, const clang::Stmt *body);
+    void addFunction(clang::Decl *decl, const clang::Stmt *body, ComplexityScores scores, const ScoreKey *scoreKey,
+                     bool hasNestedDecls);
+    void emitFunction(clang::Decl *decl, const ComplexityScores &scores);
+    void walkPending(std::vector<PendingFunction> &functions);
 
 public:
-    explicit CyclomaticComplexityASTConsumer(clang::ASTContext *Context);
-    void HandleTranslationUnit(clang::ASTContext &Context) override;
+    CyclomaticComplexityVisitor(clang::ASTContext *context, clang::DiagnosticsEngine &d,
+                                const CyclomaticComplexityOptions &options, ResultChunkHandler output,
+                                llvm::Timer *metricsTimer = nullptr);
+
+    bool shouldVisitTemplateInstantiations() const { return options.templateInstantiations; }
+
+    bool TraverseDecl(clang::Decl *decl);
+    bool TraverseLambdaExpr(clang::LambdaExpr *lambda);
+    // Measures the functions queued by TraverseDecl in parallel mode.
+    void analyzePending();
+    void reportSummary();
+
+    // Renders the pending records as one chunk and passes it on. Called
+    // whenever chunkRecords are pending and once with `last` at the end.
+    void flushResults(bool last);
+
+    ComplexityCounters getCounters() const;
 };
 
-class CyclomaticComplexityFrontendAction : public clang::ASTFrontendAction {
+// Called with the rendered results of a translation unit, either chunk by
+// chunk fresh from the visitor or all at once replayed from the
+// ComplexityCache. `last` is set on the final call.
+using ComplexityResultHandler = std::function<void(clang::CompilerInstance &instance, llvm::StringRef mainFile,
+                                                   llvm::StringRef results, bool last)>;
+
+// Identifies the compilation `instance` runs: by its object file when there
+// is one (a source file may be compiled several times with different flags)
+// and by its main file otherwise. The path is made absolute.
+std::string getTranslationUnitKey(clang::CompilerInstance &instance, llvm::StringRef mainFile);
+
+// Returns a handler that streams a translation unit to its own shard in
+// outputDir (.cy for text, .cyb for binary results). Shards are combined by
+// cyclomatic-merge. Each returned handler serves a single TU.
+ComplexityResultHandler makeShardWriter(std::string outputDir, ResultsFormat format);
+
+class CyclomaticComplexityConsumer : public clang::ASTConsumer {
+    clang::CompilerInstance &instance;
+    // Owned here because frontend actions may be destroyed before the consumer.
+    CyclomaticComplexityOptions options;
+    std::unique_ptr<ComplexityTimers> timers;
+    CyclomaticComplexityVisitor visitor;
+    ComplexityResultHandler handler;
+
 public:
-    std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(clang::CompilerInstance &CI, llvm::StringRef file) override;
+    CyclomaticComplexityConsumer(clang::CompilerInstance &instance, CyclomaticComplexityOptions options,
+                                 ComplexityResultHandler handler);
+    bool HandleTopLevelDecl(clang::DeclGroupRef group) override;
+    void HandleInlineFunctionDefinition(clang::FunctionDecl *func) override;
+    void HandleTranslationUnit(clang::ASTContext &context) override;
+
+    ComplexityCounters getCounters() const { return visitor.getCounters(); }
 };
 
 #endif // CYCLOMATIC_COMPLEXITY_H
@@ -0,0 +1,30 @@
+#ifndef FUNCTION_SCORE_CACHE_H
+#define FUNCTION_SCORE_CACHE_H
+
+#include "ComplexityResults.h"
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+
+#include <cstdint>
+#include <mutex>
+#include <optional>
+
+// Scores of functions measured by earlier analyses, keyed by USR. An entry
+// is only reused while the hash of the body it was measured from is
+// unchanged, so reanalyzing an edited file only walks the edited bodies.
+// Each function keeps one entry, replaced whenever its body changes.
+class FunctionScoreCache {
+    struct Entry {
+        uint64_t bodyHash;
+        ComplexityScores scores;
+    };
+    std::mutex lock;
+    llvm::StringMap<Entry> entries;
+
+public:
+    std::optional<ComplexityScores> lookup(llvm::StringRef usr, uint64_t bodyHash);
+    void store(llvm::StringRef usr, uint64_t bodyHash, const ComplexityScores &scores);
+};
+
+#endif // FUNCTION_SCORE_CACHE_H
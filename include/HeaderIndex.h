@@ -0,0 +1,61 @@
+#ifndef HEADER_INDEX_H
+#define HEADER_INDEX_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringRef.h"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Records which header functions have already been measured, so that a
+// function defined in a header is reported by exactly one translation unit
+// of the build. Keys are canonical decl identities (USR, file and offset).
+// Every claim remembers its owner, the translation unit that made it, so a
+// TU compiled again keeps the functions it claimed the last time.
+class HeaderIndex {
+public:
+    virtual ~HeaderIndex() = default;
+
+    // Returns true if `identity` is unclaimed or already claimed by `owner`,
+    // in which case the caller should measure the function.
+    virtual bool claim(llvm::StringRef identity, llvm::StringRef owner) = 0;
+};
+
+// Index shared between compiler processes: every claim is a file in a common
+// directory holding its owner. It is linked into place, which fails if the
+// file exists, so the first process wins without any locking.
+class DirectoryHeaderIndex : public HeaderIndex {
+    std::string directory;
+
+public:
+    explicit DirectoryHeaderIndex(std::string directory);
+    bool claim(llvm::StringRef identity, llvm::StringRef owner) override;
+};
+
+// Index shared between the worker threads of a single process.
+class InProcessHeaderIndex : public HeaderIndex {
+    std::mutex lock;
+    llvm::DenseMap<uint64_t, std::string> owners;
+
+public:
+    bool claim(llvm::StringRef identity, llvm::StringRef owner) override;
+};
+
+// Forwards to another index and keeps the identities that were granted, so
+// a cached TU can make the same claims when it is replayed. Used by a single
+// translation unit.
+class RecordingHeaderIndex : public HeaderIndex {
+    std::shared_ptr<HeaderIndex> index;
+    std::vector<std::string> claims;
+
+public:
+    explicit RecordingHeaderIndex(std::shared_ptr<HeaderIndex> index) : index(std::move(index)) {}
+    bool claim(llvm::StringRef identity, llvm::StringRef owner) override;
+
+    const std::vector<std::string> &getClaims() const { return claims; }
+};
+
+#endif // HEADER_INDEX_H
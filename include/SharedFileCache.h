@@ -0,0 +1,52 @@
+#ifndef SHARED_FILE_CACHE_H
+#define SHARED_FILE_CACHE_H
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/VirtualFileSystem.h"
+
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <system_error>
+
+// Stats and contents of the files read while scanning many translation
+// units in one process. Every header is then stat'ed and read once per scan
+// instead of once per TU that includes it, and lookups of missing files
+// along the include path are remembered too. Files are assumed not to
+// change while the scan runs.
+class SharedFileCache {
+    struct Entry {
+        llvm::ErrorOr<llvm::vfs::Status> status = std::make_error_code(std::errc::no_such_file_or_directory);
+        std::shared_ptr<llvm::MemoryBuffer> contents;
+    };
+    std::mutex lock;
+    llvm::StringMap<Entry> entries;
+    // Read by a single TU each, so their contents are not kept.
+    llvm::StringSet<> mainFiles;
+
+    friend class SharedCacheFileSystem;
+
+public:
+    explicit SharedFileCache(llvm::StringSet<> mainFiles = {}) : mainFiles(std::move(mainFiles)) {}
+};
+
+// A file system answering from a SharedFileCache, falling back to `base` for
+// what is not cached yet. Each thread needs its own instance, because the
+// working directory belongs to the file system.
+class SharedCacheFileSystem : public llvm::vfs::ProxyFileSystem {
+    SharedFileCache &cache;
+
+    std::optional<std::string> getKey(const llvm::Twine &path);
+
+public:
+    SharedCacheFileSystem(llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> base, SharedFileCache &cache)
+        : ProxyFileSystem(std::move(base)), cache(cache) {}
+
+    llvm::ErrorOr<llvm::vfs::Status> status(const llvm::Twine &path) override;
+    llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>> openFileForRead(const llvm::Twine &path) override;
+};
+
+#endif // SHARED_FILE_CACHE_H
@@ -0,0 +1,37 @@
+#include "AtomicFileWriter.h"
+
+#include "llvm/Support/Path.h"
+
+AtomicFileWriter::~AtomicFileWriter() {
+    if (out)
+        out->clear_error();
+    out.reset();
+    if (temp)
+        llvm::consumeError(temp->discard());
+}
+
+llvm::Error AtomicFileWriter::open(llvm::StringRef path) {
+    this->path = path.str();
+    llvm::sys::fs::create_directories(llvm::sys::path::parent_path(path));
+    auto file = llvm::sys::fs::TempFile::create(path + ".tmp%%%%%%%%");
+    if (!file)
+        return file.takeError();
+    temp.emplace(std::move(*file));
+    out = std::make_unique<llvm::raw_fd_ostream>(temp->FD, /*shouldClose=*/false);
+    return llvm::Error::success();
+}
+
+llvm::Error AtomicFileWriter::commit() {
+    out->flush();
+    std::error_code ec = out->error();
+    out->clear_error();
+    out.reset();
+    if (ec) {
+        llvm::consumeError(temp->discard());
+        temp.reset();
+        return llvm::errorCodeToError(ec);
+    }
+    llvm::Error err = temp->keep(path);
+    temp.reset();
+    return err;
+}
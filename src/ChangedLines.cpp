@@ -0,0 +1,143 @@
+#include "ChangedLines.h"
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+
+#include <algorithm>
+
+// Paths are keyed like the visitor sees files: real paths where the file
+// exists, so symlinks in the root do not matter.
+void ChangedLines::add(llvm::StringRef root, llvm::StringRef path, unsigned first, unsigned last) {
+    llvm::SmallString<256> absolute(path);
+    llvm::sys::fs::make_absolute(root, absolute);
+    llvm::sys::path::remove_dots(absolute, /*remove_dot_dot=*/true);
+    llvm::SmallString<256> real;
+    if (!llvm::sys::fs::real_path(absolute, real))
+        absolute = real;
+    ranges[absolute].emplace_back(first, last);
+}
+
+void ChangedLines::finalize() {
+    for (auto &entry : ranges) {
+        auto &fileRanges = entry.second;
+        std::sort(fileRanges.begin(), fileRanges.end());
+        std::vector<std::pair<unsigned, unsigned>> merged;
+        for (const auto &range : fileRanges) {
+            if (!merged.empty() && range.first <= merged.back().second + 1)
+                merged.back().second = std::max(merged.back().second, range.second);
+            else
+                merged.push_back(range);
+        }
+        fileRanges = std::move(merged);
+    }
+}
+
+llvm::Expected<ChangedLines> ChangedLines::parse(llvm::StringRef text, llvm::StringRef root) {
+    ChangedLines changes;
+    llvm::SmallVector<llvm::StringRef, 0> lines;
+    text.split(lines, '\n');
+    bool isDiff = llvm::any_of(lines, [](llvm::StringRef line) { return line.starts_with("+++ "); });
+
+    if (!isDiff) {
+        for (llvm::StringRef line : lines) {
+            line = line.trim();
+            if (line.empty())
+                continue;
+            // Paths may contain colons themselves, the line numbers cannot.
+            auto [path, numbers] = line.rsplit(':');
+            auto [firstText, lastText] = numbers.split('-');
+            unsigned first, last;
+            bool invalid = path.empty() || firstText.getAsInteger(10, first);
+            if (!invalid && lastText.empty())
+                last = first;
+            else if (!invalid)
+                invalid = lastText.getAsInteger(10, last) || last < first;
+            if (invalid)
+                return llvm::createStringError(llvm::inconvertibleErrorCode(), "invalid line range '%s'",
+                                               line.str().c_str());
+            changes.add(root, path, first, last);
+        }
+        changes.finalize();
+        return changes;
+    }
+
+    // Only the new side matters: that is what gets compiled. The counts of
+    // the hunk header tell where a hunk ends, since "--- " starting the next
+    // file looks like a removed line.
+    llvm::StringRef file;
+    unsigned line = 0, oldLeft = 0, newLeft = 0;
+    for (llvm::StringRef row : lines) {
+        if (oldLeft == 0 && newLeft == 0) {
+            if (row.consume_front("+++ ")) {
+                file = row.split('\t').first.rtrim();
+                // "/dev/null" is a deleted file; nothing of it remains to measure.
+                if (file == "/dev/null")
+                    file = "";
+                else if (file.starts_with("b/"))
+                    file = file.drop_front(2);
+            } else if (row.consume_front("@@ -")) {
+                // "@@ -<old>[,<count>] +<new>[,<count>] @@"
+                auto [oldRange, rest] = row.split(" +");
+                auto newRange = rest.split(' ').first;
+                llvm::StringRef oldCount = oldRange.split(',').second;
+                auto [newStart, newCount] = newRange.split(',');
+                oldLeft = newLeft = 1;
+                if (newStart.getAsInteger(10, line) || (!oldCount.empty() && oldCount.getAsInteger(10, oldLeft)) ||
+                    (!newCount.empty() && newCount.getAsInteger(10, newLeft)))
+                    return llvm::createStringError(llvm::inconvertibleErrorCode(), "invalid hunk header '@@ -%s'",
+                                                   row.str().c_str());
+                // An empty new side starts at the line before the removal.
+                if (newLeft == 0)
+                    ++line;
+            }
+            continue;
+        }
+
+        if (row.starts_with("+")) {
+            if (!file.empty())
+                changes.add(root, file, line, line);
+            ++line;
+            newLeft -= newLeft > 0;
+        } else if (row.starts_with("-")) {
+            // A removal touches the lines on both sides of it.
+            if (!file.empty())
+                changes.add(root, file, std::max(line, 2u) - 1, line);
+            oldLeft -= oldLeft > 0;
+        } else if (!row.starts_with("\\")) {
+            // A context line; "\ No newline at end of file" is neither.
+            ++line;
+            oldLeft -= oldLeft > 0;
+            newLeft -= newLeft > 0;
+        }
+    }
+    changes.finalize();
+    return changes;
+}
+
+llvm::Expected<ChangedLines> ChangedLines::load(llvm::StringRef path, llvm::StringRef root) {
+    auto buffer = llvm::MemoryBuffer::getFileOrSTDIN(path);
+    if (!buffer)
+        return llvm::createStringError(buffer.getError(), "cannot read '%s'", path.str().c_str());
+    return parse((*buffer)->getBuffer(), root);
+}
+
+bool ChangedLines::intersects(llvm::StringRef path, unsigned first, unsigned last) const {
+    auto it = ranges.find(path);
+    if (it == ranges.end())
+        return false;
+    // The first range ending at or after `first` is the only candidate.
+    auto range = std::lower_bound(it->second.begin(), it->second.end(), first,
+                                  [](const std::pair<unsigned, unsigned> &range, unsigned line) { return range.second < line; });
+    return range != it->second.end() && range->first <= last;
+}
+
+std::vector<llvm::StringRef> ChangedLines::getFiles() const {
+    std::vector<llvm::StringRef> files;
+    for (const auto &entry : ranges)
+        files.push_back(entry.first());
+    return files;
+}
@@ -0,0 +1,221 @@
+#include "ComplexityCache.h"
+#include "AtomicFileWriter.h"
+
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/Chrono.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <optional>
+#include <string>
+#include <vector>
+
+using namespace clang;
+
+// An entry is the magic, the results as they were streamed, one
+// "dep <size> <mtime> <hash> <absolute path>" line per file the TU read, one
+// "claim <hex identity>" line per header function it claimed and finally
+// "end <size of the results>". The dependencies and claims come last because
+// they are only complete once the TU is, while results may be streamed
+// before that.
+static constexpr llvm::StringLiteral CacheMagic = "cyclomatic-cache 6\n";
+
+namespace {
+struct Dependency {
+    uint64_t size;
+    int64_t mtime;
+    uint64_t hash;
+    llvm::StringRef path;
+};
+} // namespace
+
+// Splits an entry into its results, dependencies and header claims.
+static bool parseEntry(llvm::StringRef contents, llvm::StringRef &results, std::vector<Dependency> &deps,
+                       std::vector<std::string> &claims) {
+    if (!contents.consume_front(CacheMagic) || !contents.consume_back("\n"))
+        return false;
+    auto [body, endLine] = contents.rsplit('\n');
+    uint64_t resultsSize;
+    if (!endLine.consume_front("end ") || endLine.getAsInteger(10, resultsSize) || resultsSize > body.size())
+        return false;
+    results = body.take_front(resultsSize);
+
+    llvm::SmallVector<llvm::StringRef, 0> lines;
+    body.drop_front(resultsSize).split(lines, '\n', /*MaxSplit=*/-1, /*KeepEmpty=*/false);
+    for (llvm::StringRef line : lines) {
+        if (line.consume_front("claim ")) {
+            std::string identity;
+            if (!llvm::tryGetFromHex(line, identity))
+                return false;
+            claims.push_back(std::move(identity));
+            continue;
+        }
+        Dependency dep;
+        auto [sizeField, afterSize] = line.drop_front(4).split(' ');
+        auto [mtimeField, afterMtime] = afterSize.split(' ');
+        auto [hashField, path] = afterMtime.split(' ');
+        if (!line.starts_with("dep ") || sizeField.getAsInteger(10, dep.size) || mtimeField.getAsInteger(10, dep.mtime) ||
+            hashField.getAsInteger(16, dep.hash) || path.empty())
+            return false;
+        dep.path = path;
+        deps.push_back(dep);
+    }
+    return true;
+}
+
+ComplexityCache::ComplexityCache(std::string directory, std::string salt)
+    : directory(std::move(directory)), salt(std::move(salt)) {}
+
+std::string ComplexityCache::getEntryPath(llvm::StringRef key) const {
+    llvm::SmallString<256> path(directory);
+    llvm::sys::path::append(path, key + ".cache");
+    return std::string(path);
+}
+
+std::string ComplexityCache::getKey(CompilerInstance &instance) const {
+    std::string flags = salt;
+    flags += '\0';
+    for (const auto &arg : instance.getInvocation().getCC1CommandLine()) {
+        flags += arg;
+        flags += '\0';
+    }
+    // The compile directory, which is not the process's under
+    // cyclomatic-scan: ClangTool only moves its file system there.
+    llvm::SmallString<256> cwd(".");
+    instance.getFileManager().makeAbsolutePath(cwd);
+    llvm::sys::path::remove_dots(cwd, /*remove_dot_dot=*/true);
+    flags += cwd;
+    return llvm::utohexstr(llvm::xxHash64(flags), /*LowerCase=*/true);
+}
+
+// Checks size and modification time first and only rehashes the contents
+// when the timestamp moved, so an unchanged tree costs one stat per file.
+static bool isUnchanged(llvm::StringRef path, uint64_t size, int64_t mtime, uint64_t hash) {
+    llvm::sys::fs::file_status status;
+    if (llvm::sys::fs::status(path, status) || status.getSize() != size)
+        return false;
+    if (llvm::sys::toTimeT(status.getLastModificationTime()) == mtime)
+        return true;
+    auto buffer = llvm::MemoryBuffer::getFile(path);
+    return buffer && llvm::xxHash64((*buffer)->getBuffer()) == hash;
+}
+
+bool ComplexityCache::lookup(llvm::StringRef key, std::string &results, std::vector<std::string> &claims) const {
+    auto buffer = llvm::MemoryBuffer::getFile(getEntryPath(key));
+    if (!buffer)
+        return false;
+
+    llvm::StringRef entryResults;
+    std::vector<Dependency> deps;
+    if (!parseEntry((*buffer)->getBuffer(), entryResults, deps, claims))
+        return false;
+    for (const Dependency &dep : deps) {
+        if (!isUnchanged(dep.path, dep.size, dep.mtime, dep.hash))
+            return false;
+    }
+    results = entryResults.str();
+    return true;
+}
+
+std::optional<std::vector<std::string>> ComplexityCache::getDependencies(CompilerInstance &instance) const {
+    auto buffer = llvm::MemoryBuffer::getFile(getEntryPath(getKey(instance)));
+    if (!buffer)
+        return std::nullopt;
+    llvm::StringRef results;
+    std::vector<Dependency> deps;
+    std::vector<std::string> claims;
+    if (!parseEntry((*buffer)->getBuffer(), results, deps, claims))
+        return std::nullopt;
+    std::vector<std::string> paths;
+    for (const Dependency &dep : deps)
+        paths.push_back(dep.path.str());
+    return paths;
+}
+
+// Paths are made absolute against the compile directory, so they can be
+// checked from whatever directory the next lookup runs in.
+void ComplexityCache::writeDependencies(llvm::raw_ostream &out, const SourceManager &sm) {
+    // Every file the TU read has at least one local SLocEntry; repeated
+    // inclusions share a ContentCache, so record each one once.
+    llvm::DenseSet<const SrcMgr::ContentCache *> seen;
+    for (unsigned i = 0, e = sm.local_sloc_entry_size(); i != e; ++i) {
+        const SrcMgr::SLocEntry &sloc = sm.getLocalSLocEntry(i);
+        if (!sloc.isFile())
+            continue;
+        const SrcMgr::ContentCache &content = sloc.getFile().getContentCache();
+        const llvm::MemoryBuffer *buffer = content.getBufferIfLoaded();
+        if (!content.OrigEntry || !buffer || !seen.insert(&content).second)
+            continue;
+        llvm::SmallString<256> path(content.OrigEntry->getName());
+        sm.getFileManager().makeAbsolutePath(path);
+        out << "dep " << content.OrigEntry->getSize() << " " << content.OrigEntry->getModificationTime() << " "
+            << llvm::utohexstr(llvm::xxHash64(buffer->getBuffer()), /*LowerCase=*/true) << " " << path << "\n";
+    }
+}
+
+// The cached results hold the header functions the TU claimed. Unless the
+// claims are still the TU's, replaying them would report those functions
+// twice, so the TU is analyzed again instead.
+bool ComplexityCache::replay(CompilerInstance &instance, llvm::StringRef mainFile,
+                             const ComplexityResultHandler &handler, HeaderIndex *headerIndex) const {
+    std::string results;
+    std::vector<std::string> claims;
+    if (!lookup(getKey(instance), results, claims))
+        return false;
+    if (headerIndex) {
+        std::string owner = getTranslationUnitKey(instance, mainFile);
+        for (const std::string &identity : claims) {
+            if (!headerIndex->claim(identity, owner))
+                return false;
+        }
+    }
+    handler(instance, mainFile, results, /*last=*/true);
+    return true;
+}
+
+// The handler takes a copy of the cache: plugin actions are destroyed as soon
+// as they have created their consumer. The results are streamed into the
+// entry as they arrive and the dependencies and claims appended with the
+// last chunk.
+ComplexityResultHandler ComplexityCache::storeResults(ComplexityResultHandler handler,
+                                                      CyclomaticComplexityOptions &options) const {
+    std::shared_ptr<RecordingHeaderIndex> claims;
+    if (options.headerIndex) {
+        claims = std::make_shared<RecordingHeaderIndex>(std::move(options.headerIndex));
+        options.headerIndex = claims;
+    }
+    auto entry = std::make_shared<AtomicFileWriter>();
+    auto failed = std::make_shared<bool>(false);
+    auto resultsSize = std::make_shared<uint64_t>(0);
+    return [cache = *this, handler = std::move(handler), claims, entry, failed, resultsSize](
+               CompilerInstance &instance, llvm::StringRef mainFile, llvm::StringRef results, bool last) {
+        // The cache is an optimization; a failed write only costs a re-analysis.
+        if (!*failed && !entry->isOpen()) {
+            if (llvm::Error err = entry->open(cache.getEntryPath(cache.getKey(instance)))) {
+                llvm::consumeError(std::move(err));
+                *failed = true;
+            } else {
+                entry->stream() << CacheMagic;
+            }
+        }
+        if (!*failed) {
+            entry->stream() << results;
+            *resultsSize += results.size();
+            if (last) {
+                writeDependencies(entry->stream(), instance.getSourceManager());
+                if (claims) {
+                    for (const std::string &identity : claims->getClaims())
+                        entry->stream() << "claim " << llvm::toHex(identity, /*LowerCase=*/true) << "\n";
+                }
+                entry->stream() << "end " << *resultsSize << "\n";
+                llvm::consumeError(entry->commit());
+            }
+        }
+        handler(instance, mainFile, results, last);
+    };
+}
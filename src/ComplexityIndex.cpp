@@ -0,0 +1,249 @@
+#include "ComplexityIndex.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/Path.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <numeric>
+#include <string>
+
+using namespace llvm;
+
+namespace {
+struct DirectoryTotals {
+    uint32_t functionCount = 0;
+    uint32_t maxScores[ComplexityMetricCount] = {};
+    uint64_t totalScores[ComplexityMetricCount] = {};
+};
+} // namespace
+
+template <typename T> static void appendArray(std::string &out, const std::vector<T> &values) {
+    out.append(reinterpret_cast<const char *>(values.data()), values.size() * sizeof(T));
+}
+
+std::string normalizeIndexPath(StringRef path) {
+    SmallString<256> normalized(path);
+    sys::path::remove_dots(normalized, /*remove_dot_dot=*/true, sys::path::Style::posix);
+    return std::string(normalized);
+}
+
+void writeComplexityIndex(raw_ostream &out, ArrayRef<IndexSourceInput> sources) {
+    // Equal strings are stored once for the whole index.
+    std::string strings;
+    StringMap<uint32_t> offsets;
+    auto intern = [&](StringRef str) -> uint32_t {
+        auto [it, inserted] = offsets.try_emplace(str, strings.size());
+        if (inserted)
+            strings += str;
+        return it->second;
+    };
+
+    std::vector<IndexSource> sourceEntries(sources.size());
+    std::vector<BinaryResultsRecord> records;
+    std::vector<uint32_t> scores[ComplexityMetricCount];
+    // Ordered by path, which is the order of the directory table.
+    std::map<std::string, DirectoryTotals, std::less<>> directories;
+    std::vector<uint32_t> histograms(ComplexityMetricCount * IndexHistogramBuckets);
+
+    for (size_t i = 0; i < sources.size(); ++i) {
+        const IndexSourceInput &source = sources[i];
+        IndexSource &entry = sourceEntries[i];
+        entry.pathOffset = intern(source.path);
+        entry.pathLength = source.path.size();
+        entry.size = source.size;
+        entry.mtime = source.mtime;
+        entry.firstFunction = records.size();
+        entry.functionCount = source.functions.size();
+
+        for (const FunctionResult &result : source.functions) {
+            // Results record absolute paths, but "a/../b.h" and "b.h" would
+            // still be rolled up into different directories.
+            std::string file = normalizeIndexPath(result.file);
+            BinaryResultsRecord record;
+            record.nameOffset = intern(result.name);
+            record.nameLength = result.name.size();
+            record.fileOffset = intern(file);
+            record.fileLength = file.size();
+            record.line = result.line;
+            for (unsigned metric = 0; metric < ComplexityMetricCount; ++metric) {
+                unsigned value = result.scores.values[metric];
+                record.scores[metric] = value;
+                scores[metric].push_back(value);
+                ++histograms[metric * IndexHistogramBuckets + std::min(value, IndexHistogramBuckets - 1)];
+            }
+            records.push_back(record);
+
+            // The function counts for its file's directory, every directory
+            // above it and "" for the whole build.
+            auto add = [&](StringRef path) {
+                DirectoryTotals &totals = directories[path.str()];
+                ++totals.functionCount;
+                for (unsigned metric = 0; metric < ComplexityMetricCount; ++metric) {
+                    totals.maxScores[metric] = std::max(totals.maxScores[metric], result.scores.values[metric]);
+                    totals.totalScores[metric] += result.scores.values[metric];
+                }
+            };
+            add("");
+            for (StringRef dir = sys::path::parent_path(file, sys::path::Style::posix); !dir.empty();
+                 dir = sys::path::parent_path(dir, sys::path::Style::posix)) {
+                add(dir);
+                if (dir == sys::path::root_path(dir, sys::path::Style::posix))
+                    break;
+            }
+        }
+    }
+
+    // Ties keep the order of the sources, so equal inputs give equal indexes.
+    std::vector<support::ulittle32_t> rankings;
+    rankings.reserve(ComplexityMetricCount * records.size());
+    for (unsigned metric = 0; metric < ComplexityMetricCount; ++metric) {
+        std::vector<uint32_t> order(records.size());
+        std::iota(order.begin(), order.end(), 0);
+        const std::vector<uint32_t> &values = scores[metric];
+        std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return values[a] > values[b]; });
+        rankings.insert(rankings.end(), order.begin(), order.end());
+    }
+
+    std::vector<IndexDirectory> directoryEntries;
+    directoryEntries.reserve(directories.size());
+    for (const auto &[path, totals] : directories) {
+        IndexDirectory entry;
+        entry.pathOffset = intern(path);
+        entry.pathLength = path.size();
+        entry.functionCount = totals.functionCount;
+        for (unsigned metric = 0; metric < ComplexityMetricCount; ++metric) {
+            entry.maxScores[metric] = totals.maxScores[metric];
+            entry.totalScores[metric] = totals.totalScores[metric];
+        }
+        directoryEntries.push_back(entry);
+    }
+
+    IndexHeader header;
+    std::memcpy(header.magic, IndexHeader::Magic, sizeof(header.magic));
+    header.version = IndexHeader::Version;
+    header.sourceCount = sourceEntries.size();
+    header.functionCount = records.size();
+    header.histogramBuckets = IndexHistogramBuckets;
+    header.directoryCount = directoryEntries.size();
+    header.stringsSize = strings.size();
+    header.reserved = 0;
+
+    std::string index;
+    index.append(reinterpret_cast<const char *>(&header), sizeof(header));
+    appendArray(index, sourceEntries);
+    appendArray(index, records);
+    appendArray(index, rankings);
+    for (uint32_t count : histograms) {
+        support::ulittle32_t value(count);
+        index.append(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+    appendArray(index, directoryEntries);
+    index += strings;
+    out.write(index.data(), index.size());
+}
+
+static Error malformed(const Twine &reason) {
+    return createStringError(inconvertibleErrorCode(), "malformed cyclomatic complexity index: " + reason);
+}
+
+Expected<ComplexityIndex> ComplexityIndex::open(StringRef path) {
+    auto buffer = MemoryBuffer::getFile(path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    if (!buffer)
+        return errorCodeToError(buffer.getError());
+    return create(std::move(*buffer));
+}
+
+Expected<ComplexityIndex> ComplexityIndex::create(std::unique_ptr<MemoryBuffer> buffer) {
+    ComplexityIndex index(std::move(buffer));
+    StringRef data = index.buffer->getBuffer();
+
+    if (data.size() < sizeof(IndexHeader))
+        return malformed("truncated header");
+    auto *header = reinterpret_cast<const IndexHeader *>(data.data());
+    if (std::memcmp(header->magic, IndexHeader::Magic, sizeof(header->magic)) != 0)
+        return malformed("bad magic");
+    if (header->version != IndexHeader::Version)
+        return malformed("unsupported version " + Twine(uint32_t(header->version)));
+
+    uint64_t functionCount = header->functionCount;
+    uint64_t sourcesOffset = sizeof(IndexHeader);
+    uint64_t functionsOffset = sourcesOffset + uint64_t(header->sourceCount) * sizeof(IndexSource);
+    uint64_t rankingsOffset = functionsOffset + functionCount * sizeof(BinaryResultsRecord);
+    uint64_t histogramsOffset = rankingsOffset + ComplexityMetricCount * functionCount * sizeof(uint32_t);
+    uint64_t directoriesOffset =
+        histogramsOffset + ComplexityMetricCount * uint64_t(header->histogramBuckets) * sizeof(uint32_t);
+    uint64_t stringsOffset = directoriesOffset + uint64_t(header->directoryCount) * sizeof(IndexDirectory);
+    if (stringsOffset + header->stringsSize != data.size())
+        return malformed("size does not match header");
+
+    index.header = header;
+    index.sources = reinterpret_cast<const IndexSource *>(data.data() + sourcesOffset);
+    index.functions = reinterpret_cast<const BinaryResultsRecord *>(data.data() + functionsOffset);
+    index.rankings = reinterpret_cast<const support::ulittle32_t *>(data.data() + rankingsOffset);
+    index.histograms = reinterpret_cast<const support::ulittle32_t *>(data.data() + histogramsOffset);
+    index.directories = reinterpret_cast<const IndexDirectory *>(data.data() + directoriesOffset);
+    index.strings = data.drop_front(stringsOffset);
+
+    // Check every reference once here so the accessors need no bounds checks.
+    auto inBounds = [&](uint32_t offset, uint32_t length) { return uint64_t(offset) + length <= index.strings.size(); };
+    for (uint32_t i = 0; i < header->sourceCount; ++i) {
+        const IndexSource &source = index.sources[i];
+        if (!inBounds(source.pathOffset, source.pathLength))
+            return malformed("string out of bounds");
+        if (uint64_t(source.firstFunction) + source.functionCount > functionCount)
+            return malformed("source out of bounds");
+    }
+    for (uint64_t i = 0; i < functionCount; ++i) {
+        const BinaryResultsRecord &record = index.functions[i];
+        if (!inBounds(record.nameOffset, record.nameLength) || !inBounds(record.fileOffset, record.fileLength))
+            return malformed("string out of bounds");
+    }
+    for (uint64_t i = 0; i < ComplexityMetricCount * functionCount; ++i) {
+        if (index.rankings[i] >= functionCount)
+            return malformed("ranking out of bounds");
+    }
+    for (uint32_t i = 0; i < header->directoryCount; ++i) {
+        const IndexDirectory &directory = index.directories[i];
+        if (!inBounds(directory.pathOffset, directory.pathLength))
+            return malformed("string out of bounds");
+    }
+    return index;
+}
+
+FunctionResult ComplexityIndex::getFunction(size_t index) const {
+    const BinaryResultsRecord &record = functions[index];
+    FunctionResult result{getString(record.nameOffset, record.nameLength),
+                          getString(record.fileOffset, record.fileLength), record.line, {}};
+    for (unsigned metric = 0; metric < ComplexityMetricCount; ++metric)
+        result.scores.values[metric] = record.scores[metric];
+    return result;
+}
+
+ComplexityIndex::Source ComplexityIndex::getSource(size_t index) const {
+    const IndexSource &source = sources[index];
+    return {getString(source.pathOffset, source.pathLength), source.size, source.mtime, source.firstFunction,
+            source.functionCount};
+}
+
+ComplexityIndex::Directory ComplexityIndex::getDirectory(size_t index) const {
+    const IndexDirectory &entry = directories[index];
+    Directory directory{getString(entry.pathOffset, entry.pathLength), entry.functionCount, {}, {}};
+    for (unsigned metric = 0; metric < ComplexityMetricCount; ++metric) {
+        directory.maxScores.values[metric] = entry.maxScores[metric];
+        directory.totalScores[metric] = entry.totalScores[metric];
+    }
+    return directory;
+}
+
+std::optional<ComplexityIndex::Directory> ComplexityIndex::findDirectory(StringRef path) const {
+    const IndexDirectory *begin = directories, *end = directories + header->directoryCount;
+    const IndexDirectory *it = std::lower_bound(begin, end, path, [&](const IndexDirectory &entry, StringRef path) {
+        return getString(entry.pathOffset, entry.pathLength) < path;
+    });
+    if (it == end || getString(it->pathOffset, it->pathLength) != path)
+        return std::nullopt;
+    return getDirectory(it - begin);
+}
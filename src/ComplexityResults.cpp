@@ -0,0 +1,177 @@
+#include "ComplexityResults.h"
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/ErrorHandling.h"
+
+#include <cstring>
+#include <string>
+
+using namespace llvm;
+
+StringRef getMetricName(ComplexityMetric metric) {
+    switch (metric) {
+    case ComplexityMetric::McCabe:
+        return "Cyclomatic Complexity";
+    case ComplexityMetric::ExtendedMcCabe:
+        return "Extended Cyclomatic Complexity";
+    case ComplexityMetric::Cognitive:
+        return "Cognitive Complexity";
+    }
+    llvm_unreachable("unknown complexity metric");
+}
+
+void writeBinaryResults(raw_ostream &out, StringRef mainFile, StringRef key, ArrayRef<FunctionResult> results) {
+    // Equal strings (most often file names) are stored once per unit.
+    std::string strings;
+    StringMap<uint32_t> offsets;
+    auto intern = [&](StringRef str) -> uint32_t {
+        auto [it, inserted] = offsets.try_emplace(str, strings.size());
+        if (inserted)
+            strings += str;
+        return it->second;
+    };
+
+    std::vector<BinaryResultsRecord> records(results.size());
+    for (size_t i = 0; i < results.size(); ++i) {
+        const FunctionResult &result = results[i];
+        BinaryResultsRecord &record = records[i];
+        record.nameOffset = intern(result.name);
+        record.nameLength = result.name.size();
+        record.fileOffset = intern(result.file);
+        record.fileLength = result.file.size();
+        record.line = result.line;
+        for (unsigned metric = 0; metric < ComplexityMetricCount; ++metric)
+            record.scores[metric] = result.scores.values[metric];
+    }
+
+    BinaryResultsHeader header;
+    std::memcpy(header.magic, BinaryResultsHeader::Magic, sizeof(header.magic));
+    header.version = BinaryResultsHeader::Version;
+    header.recordCount = records.size();
+    header.mainFileOffset = intern(mainFile);
+    header.mainFileLength = mainFile.size();
+    header.keyOffset = intern(key);
+    header.keyLength = key.size();
+    header.size = sizeof(header) + records.size() * sizeof(BinaryResultsRecord) + strings.size();
+
+    std::string unit;
+    unit.reserve(header.size);
+    unit.append(reinterpret_cast<const char *>(&header), sizeof(header));
+    unit.append(reinterpret_cast<const char *>(records.data()), records.size() * sizeof(BinaryResultsRecord));
+    unit += strings;
+    out.write(unit.data(), unit.size());
+}
+
+static Error malformed(const Twine &reason) {
+    return createStringError(inconvertibleErrorCode(), "malformed cyclomatic complexity results: " + reason);
+}
+
+Expected<ComplexityResultsFile> ComplexityResultsFile::open(StringRef path) {
+    auto buffer = MemoryBuffer::getFile(path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    if (!buffer)
+        return errorCodeToError(buffer.getError());
+    return create(std::move(*buffer));
+}
+
+Expected<ComplexityResultsFile> ComplexityResultsFile::create(std::unique_ptr<MemoryBuffer> buffer) {
+    ComplexityResultsFile file(std::move(buffer));
+    StringRef data = file.buffer->getBuffer();
+
+    while (!data.empty()) {
+        if (data.size() < sizeof(BinaryResultsHeader))
+            return malformed("truncated header");
+        auto *header = reinterpret_cast<const BinaryResultsHeader *>(data.data());
+        if (std::memcmp(header->magic, BinaryResultsHeader::Magic, sizeof(header->magic)) != 0)
+            return malformed("bad magic");
+        if (header->version != BinaryResultsHeader::Version)
+            return malformed("unsupported version " + Twine(uint32_t(header->version)));
+
+        uint64_t recordsEnd = sizeof(BinaryResultsHeader) + uint64_t(header->recordCount) * sizeof(BinaryResultsRecord);
+        if (header->size > data.size() || recordsEnd > header->size)
+            return malformed("truncated unit");
+
+        auto *records = reinterpret_cast<const BinaryResultsRecord *>(data.data() + sizeof(BinaryResultsHeader));
+        StringRef strings = data.slice(recordsEnd, header->size);
+
+        // Check every string once here so the accessors need no bounds checks.
+        auto inBounds = [&](uint32_t offset, uint32_t length) { return uint64_t(offset) + length <= strings.size(); };
+        if (!inBounds(header->mainFileOffset, header->mainFileLength) || !inBounds(header->keyOffset, header->keyLength))
+            return malformed("string out of bounds");
+        for (uint32_t i = 0; i < header->recordCount; ++i) {
+            if (!inBounds(records[i].nameOffset, records[i].nameLength) ||
+                !inBounds(records[i].fileOffset, records[i].fileLength))
+                return malformed("string out of bounds");
+        }
+
+        file.units.push_back(ComplexityResultsUnit(header, records, strings));
+        data = data.drop_front(header->size);
+    }
+    return file;
+}
+
+static void printResult(raw_ostream &out, const FunctionResult &result) {
+    out << "Function: " << result.name << ", Location: " << result.file << ":" << result.line;
+    for (unsigned metric = 0; metric < ComplexityMetricCount; ++metric)
+        out << ", " << getMetricName(static_cast<ComplexityMetric>(metric)) << ": " << result.scores.values[metric];
+    out << "\n";
+}
+
+static void printUnitHeader(raw_ostream &out, StringRef mainFile, StringRef key) {
+    out << "# TU: " << mainFile << "\n";
+    if (key != mainFile)
+        out << "# Unit: " << key << "\n";
+}
+
+void printResults(raw_ostream &out, const ComplexityResultsUnit &unit) {
+    printUnitHeader(out, unit.getMainFile(), unit.getKey());
+    for (size_t i = 0; i < unit.size(); ++i)
+        printResult(out, unit[i]);
+}
+
+void printResults(raw_ostream &out, StringRef mainFile, StringRef key, ArrayRef<FunctionResult> results) {
+    printUnitHeader(out, mainFile, key);
+    for (const FunctionResult &result : results)
+        printResult(out, result);
+}
+
+// Names may contain ", " (template arguments) and paths ':', so a line is
+// taken apart from its end, where the fields are fixed.
+static bool parseResult(StringRef line, FunctionResult &result) {
+    for (unsigned metric = ComplexityMetricCount; metric-- > 0;) {
+        std::string field = (", " + getMetricName(static_cast<ComplexityMetric>(metric)) + ": ").str();
+        size_t pos = line.rfind(field);
+        if (pos == StringRef::npos || line.drop_front(pos + field.size()).getAsInteger(10, result.scores.values[metric]))
+            return false;
+        line = line.take_front(pos);
+    }
+    StringRef locationField = ", Location: ";
+    size_t pos = line.rfind(locationField);
+    if (pos == StringRef::npos || !line.starts_with("Function: "))
+        return false;
+    result.name = line.slice(strlen("Function: "), pos);
+    auto [file, lineNumber] = line.drop_front(pos + locationField.size()).rsplit(':');
+    result.file = file;
+    return !lineNumber.getAsInteger(10, result.line);
+}
+
+Expected<std::vector<ParsedResultsUnit>> parseTextResults(StringRef text) {
+    std::vector<ParsedResultsUnit> units;
+    SmallVector<StringRef, 0> lines;
+    text.split(lines, '\n', /*MaxSplit=*/-1, /*KeepEmpty=*/false);
+    for (StringRef line : lines) {
+        line = line.rtrim('\r');
+        if (line.consume_front("# TU: ")) {
+            units.push_back({line, line, {}});
+        } else if (line.consume_front("# Unit: ")) {
+            if (units.empty())
+                return malformed("unit key outside of a TU");
+            units.back().key = line;
+        } else {
+            FunctionResult result;
+            if (units.empty() || !parseResult(line, result))
+                return malformed("unexpected line '" + line + "'");
+            units.back().results.push_back(result);
+        }
+    }
+    return units;
+}
@@ -1,148 +1,988 @@
-#include <llvm/Support/CommandLine.h>
-#include <llvm/Support/Debug.h>
-#include <unordered_set>
-#include <vector>
-#include <iostream>
-#include <algorithm>
-#include <fstream> // Include fstream for file operations
+#include "CyclomaticComplexity.h"
+#include "AtomicFileWriter.h"
 
-#include "clang/AST/Expr.h"
-#include "clang/Frontend/FrontendPluginRegistry.h"
 #include "clang/AST/AST.h"
-#include "clang/AST/ASTConsumer.h"
-#include "clang/AST/RecursiveASTVisitor.h"
+#include "clang/AST/Expr.h"
 #include "clang/Basic/FileManager.h"
-#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Index/USRGeneration.h"
+#include "clang/Lex/Lexer.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/TimeProfiler.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
 
-#include <map>
-#include <string>
+#include <algorithm>
+#include <array>
+#include <tuple>
 
 using namespace clang;
 
-class CyclomaticComplexityVisitor : public RecursiveASTVisitor<CyclomaticComplexityVisitor> {
-private:
-    ASTContext *context;
-    CompilerInstance& instance;
-    DiagnosticsEngine& d;
-    unsigned int remarkID;
-    std::map<std::string, int> ComplexityMap;
-
-    bool isInHeader(Decl *decl) {
-        auto loc = decl->getLocation();
-        auto floc = context->getFullLoc(loc);
-        if (floc.isInSystemHeader()) return true;
-        auto entry = floc.getFileEntry()->getName();
-        if (entry.ends_with(".h") || entry.ends_with(".hpp")) {
-            return true;
-        }
+CyclomaticComplexityVisitor::CyclomaticComplexityVisitor(ASTContext *context, DiagnosticsEngine &d,
+                                                         const CyclomaticComplexityOptions &options, ResultChunkHandler output,
+                                                         llvm::Timer *metricsTimer)
+    : context(context), d(d), options(options), metricsTimer(metricsTimer),
+      strings(std::in_place, arena), output(std::move(output)) {
+    remarkID = d.getCustomDiagID(DiagnosticsEngine::Remark, "%0: %1");
+    summaryID = d.getCustomDiagID(DiagnosticsEngine::Remark,
+                                  "%0: %1 functions measured, %2 above %3, highest %4 in '%5'");
+    gateID = d.getCustomDiagID(DiagnosticsEngine::Error, "%0 of '%1' is %2, above the limit of %3");
+
+    // Only the shape of the graph matters: no destructor, initializer or
+    // lifetime elements, and edges stay even when a condition is constant.
+    cfgOptions.PruneTriviallyFalseEdges = false;
+}
+
+bool CyclomaticComplexityOptions::isIncluded(llvm::StringRef path) const {
+    auto matches = [path](const llvm::GlobPattern &glob) { return glob.match(path); };
+    if (!includeGlobs.empty() && llvm::none_of(includeGlobs, matches))
         return false;
+    return llvm::none_of(excludeGlobs, matches);
+}
+
+std::optional<unsigned> CyclomaticComplexityOptions::getGateLimit(llvm::StringRef path) const {
+    for (const GateRule &rule : llvm::reverse(gates)) {
+        if (!rule.glob || rule.glob->match(path))
+            return rule.limit;
     }
+    return std::nullopt;
+}
+
+llvm::Expected<CyclomaticComplexityOptions::GateRule> CyclomaticComplexityOptions::parseGateRule(llvm::StringRef spec) {
+    // Globs may contain colons themselves, the limit cannot.
+    auto [pattern, limitText] = spec.rsplit(':');
+    if (limitText.empty() && !spec.ends_with(":"))
+        std::swap(pattern, limitText);
 
-    void reportCyclomaticComplexity(FunctionDecl *func, int complexity) {
-        auto loc = context->getFullLoc(func->getLocation());
-        d.Report(loc, remarkID) << complexity;
+    GateRule rule;
+    if (limitText.getAsInteger(10, rule.limit))
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "invalid limit '%s'", limitText.str().c_str());
+    if (!pattern.empty()) {
+        auto glob = llvm::GlobPattern::create(pattern);
+        if (!glob)
+            return glob.takeError();
+        rule.glob = std::move(*glob);
     }
+    return rule;
+}
+
+// Real paths where the file system knows them, like ChangedLines keys.
+static std::string getComparablePath(FileManager &fm, FileEntryRef entry) {
+    llvm::StringRef real = entry.getFileEntry().tryGetRealPathName();
+    if (!real.empty())
+        return real.str();
+    llvm::SmallString<256> path(entry.getName());
+    fm.makeAbsolutePath(path);
+    llvm::sys::path::remove_dots(path, /*remove_dot_dot=*/true);
+    return std::string(path);
+}
+
+// Decls are filtered by the file they expand into. The answer only depends
+// on the file, so it is computed once per FileID.
+CyclomaticComplexityVisitor::FileClass CyclomaticComplexityVisitor::classifyLocation(SourceLocation loc) {
+    auto &sm = context->getSourceManager();
+    FileID fileID = sm.getFileID(sm.getExpansionLoc(loc));
+    if (fileID.isInvalid())
+        return FileClass::Excluded;
+
+    auto [it, inserted] = fileClasses.try_emplace(fileID, FileClass::Excluded);
+    if (inserted)
+        it->second = classifyFile(fileID);
+    return it->second;
+}
+
+CyclomaticComplexityVisitor::FileClass CyclomaticComplexityVisitor::classifyFile(FileID fileID) {
+    auto &sm = context->getSourceManager();
+    // Builtins, the predefines buffer and the scratch space have no file.
+    auto entry = sm.getFileEntryRefForID(fileID);
+    if (!entry || sm.isInSystemHeader(sm.getLocForStartOfFile(fileID)))
+        return FileClass::Excluded;
+
+    llvm::StringRef name = entry->getName();
+    if (!options.isIncluded(name))
+        return FileClass::Excluded;
+    if (options.changedLines && !options.changedLines->containsFile(getComparablePath(sm.getFileManager(), *entry)))
+        return FileClass::Excluded;
+    if (name.ends_with(".h") || name.ends_with(".hpp"))
+        return FileClass::Header;
+    return FileClass::Source;
+}
 
-    int calculateCyclomaticComplexity(const Stmt *stmt) {
-        if (!stmt) {
-            std::cout << "Null statement encountered!\n";
-            return 0;
+// A header function is measured only by the translation unit that claims it
+// first, so each one is reported once per build rather than once per includer.
+bool CyclomaticComplexityVisitor::shouldSkip(Decl *decl) {
+    switch (classifyLocation(decl->getLocation())) {
+    case FileClass::Source:
+        return false;
+    case FileClass::Header:
+        if (options.headerIndex && options.headerIndex->claim(getDeclIdentity(decl), options.unitKey))
+            return false;
+        ++counters.headerFunctionsSkipped;
+        return true;
+    case FileClass::Excluded:
+        return true;
+    }
+    llvm_unreachable("unknown file class");
+}
+
+// A function counts as changed if any line from its first token to its
+// closing brace is. Its file has changes, or it would have been pruned.
+bool CyclomaticComplexityVisitor::isChanged(const Decl *decl) {
+    auto &sm = context->getSourceManager();
+    CharSourceRange range = sm.getExpansionRange(decl->getSourceRange());
+    auto entry = sm.getFileEntryRefForID(sm.getFileID(range.getBegin()));
+    if (!entry)
+        return false;
+    return options.changedLines->intersects(getComparablePath(sm.getFileManager(), *entry),
+                                            sm.getExpansionLineNumber(range.getBegin()),
+                                            sm.getExpansionLineNumber(range.getEnd()));
+}
+
+// The USR alone is not unique for entities with internal linkage, so the
+// real path of the defining file and the offset of the definition are added.
+std::string CyclomaticComplexityVisitor::getDeclIdentity(const Decl *decl) {
+    llvm::SmallString<128> identity;
+    index::generateUSRForDecl(decl, identity);
+
+    auto &sm = context->getSourceManager();
+    auto [fileID, offset] = sm.getDecomposedLoc(sm.getFileLoc(decl->getLocation()));
+    if (auto entry = sm.getFileEntryRefForID(fileID)) {
+        llvm::StringRef path = entry->getFileEntry().tryGetRealPathName();
+        identity += '\0';
+        identity += path.empty() ? entry->getName() : path;
+    }
+    identity += '\0';
+    identity += llvm::utostr(offset);
+    return std::string(identity);
+}
+
+// Called right after the function has been recorded, so records.back()
+// is its entry.
+void CyclomaticComplexityVisitor::reportComplexity(Decl *decl, const ComplexityScores &scores) {
+    unsigned value = scores[options.metric];
+    ++functionsMeasured;
+    ++counters.functionsVisited;
+    if (value > maxComplexity) {
+        maxComplexity = value;
+        maxComplexityName = records.back().name.str();
+    }
+    if (!options.gates.empty()) {
+        // Like the include and exclude globs, gates match the file as spelled.
+        auto &sm = context->getSourceManager();
+        llvm::StringRef file = sm.getFilename(sm.getExpansionLoc(decl->getLocation()));
+        if (auto limit = options.getGateLimit(file); limit && value > *limit) {
+            ++counters.gateViolations;
+            d.Report(context->getFullLoc(decl->getLocation()), gateID)
+                << getMetricName(options.metric) << records.back().name << value << *limit;
         }
-        int complexity = 1; // Start with 1 for the function itself
-        complexity += countBranchingStatements(stmt);
-        return complexity;
     }
+    if (value <= options.remarkThreshold)
+        return;
+    ++functionsAboveThreshold;
+
+    if (options.remarks == CyclomaticComplexityOptions::RemarkMode::All) {
+        auto loc = context->getFullLoc(decl->getLocation());
+        d.Report(loc, remarkID) << getMetricName(options.metric) << value;
+    }
+}
+
+void CyclomaticComplexityVisitor::reportSummary() {
+    if (options.remarks != CyclomaticComplexityOptions::RemarkMode::Summary || functionsMeasured == 0)
+        return;
+    auto &sm = context->getSourceManager();
+    d.Report(sm.getLocForStartOfFile(sm.getMainFileID()), summaryID)
+        << getMetricName(options.metric) << functionsMeasured << functionsAboveThreshold << options.remarkThreshold << maxComplexity << maxComplexityName;
+}
 
-    int countBranchingStatements(const Stmt *stmt) {
-        int count = 0;
-        if (isa<IfStmt>(stmt) || isa<SwitchStmt>(stmt) || isa<ForStmt>(stmt) || 
-            isa<WhileStmt>(stmt) || isa<DoStmt>(stmt) || isa<ConditionalOperator>(stmt)) {
-            count++;
+StringRef getStatementKindName(StatementKind kind) {
+    switch (kind) {
+    case StatementKind::Branch:
+        return "branches";
+    case StatementKind::Loop:
+        return "loops";
+    case StatementKind::Case:
+        return "case labels";
+    case StatementKind::Jump:
+        return "jumps";
+    case StatementKind::Return:
+        return "returns";
+    case StatementKind::Call:
+        return "calls";
+    case StatementKind::Operator:
+        return "operators";
+    case StatementKind::Operand:
+        return "operands";
+    case StatementKind::Declaration:
+        return "declarations";
+    case StatementKind::Other:
+        return "other";
+    }
+    llvm_unreachable("unknown statement kind");
+}
+
+static constexpr StatementKind classifyStmtClass(Stmt::StmtClass stmtClass) {
+    switch (stmtClass) {
+    case Stmt::IfStmtClass:
+    case Stmt::SwitchStmtClass:
+    case Stmt::ConditionalOperatorClass:
+    case Stmt::BinaryConditionalOperatorClass:
+        return StatementKind::Branch;
+    case Stmt::ForStmtClass:
+    case Stmt::CXXForRangeStmtClass:
+    case Stmt::WhileStmtClass:
+    case Stmt::DoStmtClass:
+    case Stmt::ObjCForCollectionStmtClass:
+        return StatementKind::Loop;
+    case Stmt::CaseStmtClass:
+    case Stmt::DefaultStmtClass:
+        return StatementKind::Case;
+    case Stmt::GotoStmtClass:
+    case Stmt::IndirectGotoStmtClass:
+    case Stmt::BreakStmtClass:
+    case Stmt::ContinueStmtClass:
+    case Stmt::CXXThrowExprClass:
+        return StatementKind::Jump;
+    case Stmt::ReturnStmtClass:
+    case Stmt::CoreturnStmtClass:
+        return StatementKind::Return;
+    case Stmt::CallExprClass:
+    case Stmt::CXXMemberCallExprClass:
+    case Stmt::CXXOperatorCallExprClass:
+    case Stmt::UserDefinedLiteralClass:
+    case Stmt::CUDAKernelCallExprClass:
+    case Stmt::CXXConstructExprClass:
+    case Stmt::CXXTemporaryObjectExprClass:
+    case Stmt::ObjCMessageExprClass:
+        return StatementKind::Call;
+    case Stmt::UnaryOperatorClass:
+    case Stmt::BinaryOperatorClass:
+    case Stmt::CompoundAssignOperatorClass:
+        return StatementKind::Operator;
+    case Stmt::DeclRefExprClass:
+    case Stmt::MemberExprClass:
+    case Stmt::IntegerLiteralClass:
+    case Stmt::FloatingLiteralClass:
+    case Stmt::CharacterLiteralClass:
+    case Stmt::StringLiteralClass:
+    case Stmt::CXXBoolLiteralExprClass:
+    case Stmt::CXXNullPtrLiteralExprClass:
+        return StatementKind::Operand;
+    case Stmt::DeclStmtClass:
+        return StatementKind::Declaration;
+    default:
+        return StatementKind::Other;
+    }
+}
+
+// Built at compile time, so counting a statement is one indexed load.
+static constexpr auto StatementKinds = [] {
+    std::array<StatementKind, Stmt::lastStmtConstant + 1> kinds{};
+    for (unsigned stmtClass = 0; stmtClass < kinds.size(); ++stmtClass)
+        kinds[stmtClass] = classifyStmtClass(static_cast<Stmt::StmtClass>(stmtClass));
+    return kinds;
+}();
+
+// All metrics are computed in one walk. Each statement is dispatched once on
+// its class; `nested` receives the children that are one cognitive nesting
+// level deeper than the statement itself.
+//
+// Unless `instantiated` is set, nothing outside the statements themselves is
+// read or written, so walks with separate states can run concurrently.
+ComplexityScores CyclomaticComplexityVisitor::calculateComplexity(const Stmt *body, bool instantiated, WalkState &state) {
+    auto &workStack = state.workStack;
+    auto &nestedDecls = state.nestedDecls;
+    ComplexityScores scores;
+    unsigned &mcCabe = scores[ComplexityMetric::McCabe];
+    unsigned &extended = scores[ComplexityMetric::ExtendedMcCabe];
+    unsigned &cognitive = scores[ComplexityMetric::Cognitive];
+    mcCabe = extended = 1; // Start with 1 for the function itself
+
+    workStack.push_back({body, 0});
+    while (!workStack.empty()) {
+        WorkItem item = workStack.pop_back_val();
+        const Stmt *stmt = item.stmt;
+        ++state.statements[StatementKinds[stmt->getStmtClass()]];
+        const Stmt *nested[2] = {nullptr, nullptr};
+        LogicalSequence sequence = LogicalSequence::None;
+
+        switch (stmt->getStmtClass()) {
+        case Stmt::IfStmtClass: {
+            auto *ifStmt = cast<IfStmt>(stmt);
+            // In an instantiation `if constexpr` has been decided at compile time:
+            // it is not a decision point and only the kept arm belongs to the body.
+            const Stmt *arm;
+            if (instantiated && ifStmt->isConstexpr() && getConstexprArm(ifStmt, arm)) {
+                if (ifStmt->getInit())
+                    workStack.push_back({ifStmt->getInit(), item.nesting});
+                if (arm)
+                    workStack.push_back({arm, item.nesting});
+                continue;
+            }
+
+            ++mcCabe;
+            ++extended;
+            // `else if` continues the chain of its parent and is not nested.
+            cognitive += item.elseIf ? 1 : 1 + item.nesting;
+            if (const Stmt *elseStmt = ifStmt->getElse()) {
+                if (isa<IfStmt>(elseStmt)) {
+                    workStack.push_back({elseStmt, item.nesting, LogicalSequence::None, /*elseIf=*/true});
+                } else {
+                    ++cognitive;
+                    workStack.push_back({elseStmt, item.nesting + 1});
+                }
+            }
+            workStack.push_back({ifStmt->getThen(), item.nesting + 1});
+            for (const Stmt *child : {ifStmt->getInit(), static_cast<const Stmt *>(ifStmt->getConditionVariableDeclStmt()),
+                                      static_cast<const Stmt *>(ifStmt->getCond())}) {
+                if (child)
+                    workStack.push_back({child, item.nesting});
+            }
+            continue;
+        }
+        case Stmt::ForStmtClass:
+        case Stmt::CXXForRangeStmtClass:
+        case Stmt::WhileStmtClass:
+        case Stmt::DoStmtClass:
+            ++mcCabe;
+            ++extended;
+            cognitive += 1 + item.nesting;
+            if (auto *forStmt = dyn_cast<ForStmt>(stmt))
+                nested[0] = forStmt->getBody();
+            else if (auto *rangeStmt = dyn_cast<CXXForRangeStmt>(stmt))
+                nested[0] = rangeStmt->getBody();
+            else if (auto *whileStmt = dyn_cast<WhileStmt>(stmt))
+                nested[0] = whileStmt->getBody();
+            else
+                nested[0] = cast<DoStmt>(stmt)->getBody();
+            break;
+        case Stmt::SwitchStmtClass:
+            // For McCabe each case label is a decision, not the switch.
+            cognitive += 1 + item.nesting;
+            nested[0] = cast<SwitchStmt>(stmt)->getBody();
+            break;
+        case Stmt::CaseStmtClass:
+            ++mcCabe;
+            ++extended;
+            break;
+        case Stmt::CXXCatchStmtClass:
+            ++mcCabe;
+            ++extended;
+            cognitive += 1 + item.nesting;
+            nested[0] = cast<CXXCatchStmt>(stmt)->getHandlerBlock();
+            break;
+        case Stmt::ConditionalOperatorClass:
+        case Stmt::BinaryConditionalOperatorClass: {
+            auto *conditional = cast<AbstractConditionalOperator>(stmt);
+            ++mcCabe;
+            ++extended;
+            cognitive += 1 + item.nesting;
+            nested[0] = conditional->getTrueExpr();
+            nested[1] = conditional->getFalseExpr();
+            break;
+        }
+        case Stmt::BinaryOperatorClass: {
+            auto *binary = cast<BinaryOperator>(stmt);
+            if (!binary->isLogicalOp())
+                break;
+            ++extended;
+            sequence = binary->getOpcode() == BO_LAnd ? LogicalSequence::And : LogicalSequence::Or;
+            if (sequence != item.sequence)
+                ++cognitive;
+            break;
+        }
+        case Stmt::ParenExprClass:
+            // `(a && b) && c` is still a single sequence.
+            sequence = item.sequence;
+            break;
+        case Stmt::GotoStmtClass:
+        case Stmt::IndirectGotoStmtClass:
+            ++cognitive;
+            break;
+        case Stmt::LambdaExprClass: {
+            // Lambdas and blocks are measured as functions of their own; only
+            // the capture initializers run as part of the enclosing function.
+            auto *lambda = cast<LambdaExpr>(stmt);
+            for (const Expr *init : lambda->capture_inits()) {
+                if (init)
+                    workStack.push_back({init, item.nesting});
+            }
+            // The call operator is looked up later by TraverseDecl, since the
+            // lookup may build the class's lookup table.
+            nestedDecls.push_back(lambda->getLambdaClass());
+            continue;
         }
-        for (auto child : stmt->children()) {
-            if (child) {
-                count += countBranchingStatements(child);
+        case Stmt::BlockExprClass:
+            nestedDecls.push_back(const_cast<BlockDecl *>(cast<BlockExpr>(stmt)->getBlockDecl()));
+            continue;
+        case Stmt::DeclStmtClass:
+            for (auto *decl : cast<DeclStmt>(stmt)->decls()) {
+                if (isa<TagDecl>(decl))
+                    nestedDecls.push_back(decl);
             }
+            break;
+        default:
+            break;
+        }
+
+        for (const Stmt *child : stmt->children()) {
+            if (!child)
+                continue;
+            bool deeper = child == nested[0] || child == nested[1];
+            workStack.push_back({child, item.nesting + deeper, sequence});
         }
-        return count;
     }
+    return scores;
+}
 
-public:
-    explicit CyclomaticComplexityVisitor(ASTContext *context, CompilerInstance& instance)
-        : context(context), instance(instance), d(instance.getDiagnostics()) {
-        remarkID = d.getCustomDiagID(DiagnosticsEngine::Remark, "Cyclomatic Complexity: %0");
+// Returns false if the condition of an instantiated `if constexpr` cannot be
+// evaluated, e.g. because it still depends on an enclosing generic lambda.
+bool CyclomaticComplexityVisitor::getConstexprArm(const IfStmt *ifStmt, const Stmt *&arm) {
+    const Expr *cond = ifStmt->getCond();
+    bool value;
+    if (!cond || cond->isValueDependent() || !cond->EvaluateAsBooleanCondition(value, *context))
+        return false;
+    arm = value ? ifStmt->getThen() : ifStmt->getElse();
+    return true;
+}
+
+// Records what can differ between instantiations of one pattern: which arm
+// every `if constexpr` kept, and whether each `&&` and `||` is built in or
+// resolved to an overload, which is a call and not a decision. Expressions
+// are visited too, since statement expressions can hold an `if constexpr`.
+// Returns false for bodies that cannot share their scores, among them those
+// with lambdas, blocks or local classes: every instantiation has its own,
+// and they are reported when the body is walked.
+bool CyclomaticComplexityVisitor::collectInstantiationShape(const Stmt *body, std::string &shape) {
+    auto &workStack = walk.workStack;
+    workStack.push_back({body, 0});
+    auto fail = [&] {
+        workStack.clear();
+        return false;
+    };
+    while (!workStack.empty()) {
+        const Stmt *stmt = workStack.pop_back_val().stmt;
+        switch (stmt->getStmtClass()) {
+        case Stmt::IfStmtClass: {
+            auto *ifStmt = cast<IfStmt>(stmt);
+            if (!ifStmt->isConstexpr())
+                break;
+            const Stmt *arm;
+            if (!getConstexprArm(ifStmt, arm))
+                return fail();
+            shape += arm == ifStmt->getThen() ? '1' : '0';
+            if (arm)
+                workStack.push_back({arm, 0});
+            continue;
+        }
+        case Stmt::BinaryOperatorClass:
+            if (auto *binary = cast<BinaryOperator>(stmt); binary->isLogicalOp())
+                shape += binary->getOpcode() == BO_LAnd ? 'a' : 'o';
+            break;
+        case Stmt::CXXOperatorCallExprClass: {
+            OverloadedOperatorKind op = cast<CXXOperatorCallExpr>(stmt)->getOperator();
+            if (op == OO_AmpAmp || op == OO_PipePipe)
+                shape += op == OO_AmpAmp ? 'A' : 'O';
+            break;
+        }
+        case Stmt::LambdaExprClass:
+        case Stmt::BlockExprClass:
+            return fail();
+        case Stmt::DeclStmtClass:
+            for (auto *decl : cast<DeclStmt>(stmt)->decls()) {
+                if (isa<TagDecl>(decl))
+                    return fail();
+            }
+            break;
+        default:
+            break;
+        }
+        for (const Stmt *child : stmt->children()) {
+            if (child)
+                workStack.push_back({child, 0});
+        }
     }
+    return true;
+}
 
-    virtual bool VisitFunctionDecl(FunctionDecl *func) {
-        if (isInHeader(func))
-            return true;
+// Instantiations of one pattern differ only in their shape, so the shape and
+// the pattern identify the result. A template instantiated thousands of
+// times is fully walked once per distinct shape.
+ComplexityScores CyclomaticComplexityVisitor::calculateInstantiationComplexity(FunctionDecl *func) {
+    const FunctionDecl *pattern = func->getTemplateInstantiationPattern();
+    std::string key;
+    if (!pattern || !collectInstantiationShape(func->getBody(), key))
+        return calculateComplexity(func->getBody(), /*instantiated=*/true, walk);
+
+    key.append(reinterpret_cast<const char *>(&pattern), sizeof(pattern));
+    auto [it, inserted] = instantiationComplexity.try_emplace(key);
+    if (inserted)
+        it->second = calculateComplexity(func->getBody(), /*instantiated=*/true, walk);
+    return it->second;
+}
+
+// CFG::buildCFG is preferred here over an AnalysisDeclContextManager, which
+// keeps every graph alive until the end of the TU although each is used once.
+std::optional<unsigned> CyclomaticComplexityVisitor::calculateGraphComplexity(const Decl *decl, const Stmt *body) {
+    std::unique_ptr<CFG> cfg = CFG::buildCFG(decl, const_cast<Stmt *>(body), context, cfgOptions);
+    if (!cfg)
+        return std::nullopt;
 
-        if (func->hasBody()) {
-            int complexity = calculateCyclomaticComplexity(func->getBody());
-            ComplexityMap[func->getNameAsString()] = complexity;
-            reportCyclomaticComplexity(func, complexity);
+    // Every && and || ends a block of its own. McCabe does not count them
+    // (ExtendedMcCabe does), so the extra edge of each is left out.
+    unsigned edges = 0;
+    for (const CFGBlock *block : *cfg) {
+        for (const CFGBlock::AdjacentBlock &succ : block->succs()) {
+            if (succ)
+                ++edges;
         }
+        if (auto *binary = dyn_cast_or_null<BinaryOperator>(block->getTerminatorStmt());
+            binary && binary->isLogicalOp() && edges > 0)
+            --edges;
+    }
+    // The entry and exit blocks are part of the graph, so a body is a single
+    // connected component unless it has unreachable blocks without successors.
+    if (edges + 2 <= cfg->size())
+        return std::nullopt;
+    return edges + 2 - cfg->size();
+}
+
+// Function bodies are walked by calculateComplexity rather than
+// by RecursiveASTVisitor, so every statement is visited exactly once.
+bool CyclomaticComplexityVisitor::TraverseDecl(Decl *decl) {
+    // Declarations loaded from a PCH or module were measured when that PCH or
+    // module was built, so they are neither re-walked nor deserialized here.
+    if (decl && decl->isFromASTFile())
+        return true;
+
+    // Lambda classes found in a body stand for their call operator.
+    if (auto *record = dyn_cast_or_null<CXXRecordDecl>(decl); record && record->isLambda())
+        decl = record->getLambdaCallOperator();
+
+    // Special members Sema defines implicitly have no source of their own.
+    // RecursiveASTVisitor would skip them; since bodies no longer go through
+    // it, they are skipped here.
+    if (decl && decl->isImplicit())
+        return true;
+
+    // Namespaces, linkage specs and classes from system or excluded files are
+    // pruned as a whole instead of throwing their functions away one by one.
+    if (decl && !isa<TranslationUnitDecl>(decl) && classifyLocation(decl->getLocation()) == FileClass::Excluded)
+        return true;
+
+    const Stmt *body = nullptr;
+    auto *func = dyn_cast_or_null<FunctionDecl>(decl);
+    if (func && func->doesThisDeclarationHaveABody())
+        body = func->getBody();
+    else if (auto *block = dyn_cast_or_null<BlockDecl>(decl))
+        body = block->getBody();
+    // Bodies of templates under -fdelayed-template-parsing are only parsed
+    // on demand; until then there is nothing to measure.
+    if (!body)
+        return RecursiveASTVisitor::TraverseDecl(decl);
+
+    // Sema passes instantiations to the consumer as top-level declarations.
+    bool instantiated = func && isTemplateInstantiation(func->getTemplateSpecializationKind());
+    if (instantiated && !options.templateInstantiations)
+        return true;
+
+    // In incremental mode a function may be reached while parsing and again
+    // by the sweep at the end of the TU.
+    if (options.incremental && !measured.insert(decl).second)
+        return true;
+
+    if (options.changedLines && !isChanged(decl))
+        return true;
+
+    if (shouldSkip(decl))
+        return true;
+
+    // Instantiations are cached per pattern already.
+    std::optional<ScoreKey> scoreKey;
+    if (options.scoreCache && !instantiated) {
+        scoreKey = getScoreKey(decl, body);
+        if (auto scores = scoreKey ? options.scoreCache->lookup(scoreKey->usr, scoreKey->bodyHash) : std::nullopt) {
+            ++counters.functionsReused;
+            emitFunction(decl, *scores);
+            return true;
+        }
+    }
+
+    // Instantiations evaluate `if constexpr` conditions, which is not safe
+    // off the main thread, so they are always measured right away.
+    if (options.threads != 1 && !instantiated) {
+        pending.push_back({decl, body, {}, {}, std::move(scoreKey)});
         return true;
     }
 
-    void writeComplexityToFile(const std::string &filename) {
-        std::ofstream outFile(filename);
-        if (!outFile.is_open()) {
-            std::cerr << "Error opening file: " << filename << std::endl;
-            return;
+    auto &nestedDecls = walk.nestedDecls;
+    size_t firstNested = nestedDecls.size();
+    ComplexityScores scores;
+    {
+        llvm::TimeTraceScope scope("CyclomaticComplexityFunction", [decl] {
+            auto *named = dyn_cast<NamedDecl>(decl);
+            return named ? named->getQualifiedNameAsString() : std::string("(block)");
+        });
+        llvm::TimeRegion region(metricsTimer);
+        scores = instantiated ? calculateInstantiationComplexity(func)
+                              : calculateComplexity(body, /*instantiated=*/false, walk);
+    }
+    addFunction(decl, body, scores, scoreKey ? &*scoreKey : nullptr, nestedDecls.size() > firstNested);
+
+    bool result = true;
+    for (size_t i = firstNested; i < nestedDecls.size() && result; ++i)
+        result = TraverseDecl(nestedDecls[i]);
+    nestedDecls.truncate(firstNested);
+    return result;
+}
+
+// The hash is of the body's source text, so a body that merely moved keeps
+// its entry, and computing it is a pass over the characters rather than a
+// walk over the AST, which could be as deep as the one it saves. The text
+// does not show what a macro expands to, so bodies using one are not cached;
+// raw lexing is iterative and finds them. Blocks have no USR and are not
+// cached either.
+std::optional<CyclomaticComplexityVisitor::ScoreKey> CyclomaticComplexityVisitor::getScoreKey(const Decl *decl,
+                                                                                         const Stmt *body) {
+    if (!isa<FunctionDecl>(decl))
+        return std::nullopt;
+    SourceRange range = body->getSourceRange();
+    if (range.getBegin().isMacroID() || range.getEnd().isMacroID())
+        return std::nullopt;
+    auto &sm = context->getSourceManager();
+    bool invalid = false;
+    llvm::StringRef text =
+        Lexer::getSourceText(CharSourceRange::getTokenRange(range), sm, context->getLangOpts(), &invalid);
+    if (invalid || text.empty())
+        return std::nullopt;
+
+    // The lexer relies on the null terminator of the file buffer, so it is
+    // started inside the file rather than on the text alone.
+    FileID fileID = sm.getFileID(range.getBegin());
+    llvm::StringRef buffer = sm.getBufferData(fileID, &invalid);
+    if (invalid)
+        return std::nullopt;
+    Lexer lexer(sm.getLocForStartOfFile(fileID), context->getLangOpts(), buffer.begin(), text.begin(), buffer.end());
+    Token token;
+    while (lexer.getBufferLocation() < text.end()) {
+        lexer.LexFromRawLexer(token);
+        if (token.is(tok::eof))
+            break;
+        if (token.is(tok::raw_identifier)) {
+            auto it = context->Idents.find(token.getRawIdentifier());
+            if (it != context->Idents.end() && it->second->hadMacroDefinition())
+                return std::nullopt;
         }
+    }
+
+    llvm::SmallString<128> usr;
+    if (index::generateUSRForDecl(decl, usr))
+        return std::nullopt;
+    return ScoreKey{std::string(usr), llvm::xxHash64(text)};
+}
 
-        for (const auto &entry : ComplexityMap) {
-            outFile << "Function: " << entry.first << ", Cyclomatic Complexity: " << entry.second << std::endl;
+void CyclomaticComplexityVisitor::addFunction(Decl *decl, const Stmt *body, ComplexityScores scores,
+                                              const ScoreKey *scoreKey, bool hasNestedDecls) {
+    // Graphs are much more expensive than the walk, so only functions that
+    // the walk already rates as complex get one.
+    if (options.cfgThreshold && scores[ComplexityMetric::McCabe] > *options.cfgThreshold) {
+        if (auto exact = calculateGraphComplexity(decl, body))
+            scores[ComplexityMetric::McCabe] = *exact;
+    }
+    // Lambdas, blocks and local classes are only found by walking the body
+    // they are in, so such bodies are measured every time.
+    if (scoreKey && !hasNestedDecls)
+        options.scoreCache->store(scoreKey->usr, scoreKey->bodyHash, scores);
+    emitFunction(decl, scores);
+}
+
+void CyclomaticComplexityVisitor::emitFunction(Decl *decl, const ComplexityScores &scores) {
+    recordComplexity(decl, scores);
+    reportComplexity(decl, scores);
+    if (records.size() >= std::max(options.chunkRecords, 1u))
+        flushResults(/*last=*/false);
+}
+
+// The queue is split into contiguous chunks, each walked by one task with
+// its own state into its own slots, so workers never synchronize.
+void CyclomaticComplexityVisitor::walkPending(std::vector<PendingFunction> &functions) {
+    llvm::TimeTraceScope scope("CyclomaticComplexityWalk", [&] { return std::to_string(functions.size()) + " functions"; });
+    llvm::TimeRegion region(metricsTimer);
+    llvm::ThreadPool pool(llvm::hardware_concurrency(options.threads));
+    size_t chunks = std::min<size_t>(functions.size(), pool.getMaxConcurrency() * 4);
+    size_t chunkSize = (functions.size() + chunks - 1) / chunks;
+    std::vector<StatementHistogram> statements(chunks);
+    for (size_t begin = 0; begin < functions.size(); begin += chunkSize) {
+        size_t end = std::min(begin + chunkSize, functions.size());
+        pool.async([this, &functions, &statements, begin, end, chunk = begin / chunkSize]() {
+            WalkState state;
+            for (size_t i = begin; i < end; ++i) {
+                PendingFunction &function = functions[i];
+                function.scores = calculateComplexity(function.body, /*instantiated=*/false, state);
+                function.nestedDecls.assign(state.nestedDecls.begin(), state.nestedDecls.end());
+                state.nestedDecls.clear();
+            }
+            statements[chunk] = state.statements;
+        });
+    }
+    pool.wait();
+    for (const StatementHistogram &histogram : statements)
+        counters.statements += histogram;
+}
+
+// Results are recorded in queue order, so the output does not depend on how
+// the walks were scheduled. Nested declarations may queue more functions,
+// which are handled in the next round.
+void CyclomaticComplexityVisitor::analyzePending() {
+    while (!pending.empty()) {
+        std::vector<PendingFunction> functions = std::move(pending);
+        pending.clear();
+        walkPending(functions);
+        for (PendingFunction &function : functions) {
+            addFunction(function.decl, function.body, function.scores,
+                        function.scoreKey ? &*function.scoreKey : nullptr, !function.nestedDecls.empty());
+            for (Decl *nested : function.nestedDecls)
+                TraverseDecl(nested);
         }
-        outFile.close();
     }
-};
+}
+
+// Lambdas outside of function bodies (variable initializers, default member
+// initializers) are reached through RecursiveASTVisitor. Their call operator
+// is measured like any other function instead of walking the body in place.
+bool CyclomaticComplexityVisitor::TraverseLambdaExpr(LambdaExpr *lambda) {
+    return TraverseDecl(lambda->getCallOperator());
+}
 
-class CyclomaticComplexityConsumer : public ASTConsumer {
-    CompilerInstance& instance;
-    CyclomaticComplexityVisitor visitor;
+// Names and file paths are interned, so a record is a few words and the
+// table grows by appending in traversal order.
+void CyclomaticComplexityVisitor::recordComplexity(Decl *decl, const ComplexityScores &scores) {
+    llvm::SmallString<128> name;
+    llvm::raw_svector_ostream nameStream(name);
+    if (auto *func = dyn_cast<FunctionDecl>(decl)) {
+        // Includes the template arguments of instantiations and specializations.
+        func->getNameForDiagnostic(nameStream, context->getPrintingPolicy(), /*Qualified=*/true);
+    } else {
+        // Blocks have no name; they are named after the function they are in.
+        auto *enclosing = Decl::castFromDeclContext(decl->getDeclContext()->getNonClosureAncestor());
+        if (auto *named = dyn_cast<NamedDecl>(enclosing)) {
+            named->getNameForDiagnostic(nameStream, context->getPrintingPolicy(), /*Qualified=*/true);
+            nameStream << "::";
+        }
+        nameStream << "(block)";
+    }
 
-public:
-    CyclomaticComplexityConsumer(CompilerInstance& instance)
-        : instance(instance), visitor(&instance.getASTContext(), instance) {}
+    auto &sm = context->getSourceManager();
+    SourceLocation loc = sm.getExpansionLoc(decl->getLocation());
+    records.push_back(
+        {strings->save(name), strings->save(getRecordedPath(loc)), sm.getExpansionLineNumber(loc), scores});
+}
 
-    virtual void HandleTranslationUnit(ASTContext &context) override {
-        visitor.TraverseDecl(context.getTranslationUnitDecl());
-        visitor.writeComplexityToFile("results.cy");
+// Results are merged and indexed away from the compile directory, so paths
+// are made absolute against it while it is known.
+llvm::StringRef CyclomaticComplexityVisitor::getRecordedPath(SourceLocation loc) {
+    auto &sm = context->getSourceManager();
+    auto [it, inserted] = recordedPaths.try_emplace(sm.getFileID(loc));
+    if (inserted) {
+        llvm::SmallString<256> path(sm.getFilename(loc));
+        sm.getFileManager().makeAbsolutePath(path);
+        llvm::sys::path::remove_dots(path, /*remove_dot_dot=*/true);
+        it->second = std::string(path);
     }
-};
+    return it->second;
+}
+
+ComplexityCounters CyclomaticComplexityVisitor::getCounters() const {
+    ComplexityCounters result = counters;
+    result.statements += walk.statements;
+    return result;
+}
+
+void CyclomaticComplexityVisitor::flushResults(bool last) {
+    if (records.empty() && !last)
+        return;
+    auto &sm = context->getSourceManager();
+    llvm::StringRef mainFile;
+    if (auto entry = sm.getFileEntryRefForID(sm.getMainFileID()))
+        mainFile = entry->getName();
 
-class CyclomaticComplexityAction : public PluginASTAction {
-protected:
-    virtual std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance& instance, llvm::StringRef) override {
-        return std::make_unique<CyclomaticComplexityConsumer>(instance);
+    // Each chunk is sorted on its own; cyclomatic-merge puts the chunks with
+    // the same key back together and restores the order of the whole TU.
+    llvm::sort(records, [](const FunctionResult &lhs, const FunctionResult &rhs) {
+        return std::tie(lhs.name, lhs.file, lhs.line) < std::tie(rhs.name, rhs.file, rhs.line);
+    });
+
+    // The text report is printed from the binary unit so that the two
+    // formats cannot drift apart.
+    std::string unit;
+    llvm::raw_string_ostream unitStream(unit);
+    writeBinaryResults(unitStream, mainFile, options.unitKey.empty() ? mainFile : llvm::StringRef(options.unitKey),
+                       records);
+    unitStream.flush();
+    std::string chunk;
+    if (options.format == ResultsFormat::Text) {
+        auto file = ComplexityResultsFile::create(llvm::MemoryBuffer::getMemBuffer(unit, "", /*RequiresNullTerminator=*/false));
+        if (file) {
+            llvm::raw_string_ostream out(chunk);
+            printResults(out, file->getUnits().front());
+        } else {
+            llvm::consumeError(file.takeError());
+        }
     }
+    llvm::StringRef rendered = options.format == ResultsFormat::Text ? llvm::StringRef(chunk) : llvm::StringRef(unit);
+    counters.bytesWritten += rendered.size();
+    output(mainFile, rendered, last);
 
-    virtual bool ParseArgs(const CompilerInstance&, const std::vector<std::string>&) override {
-        return true;
+    records.clear();
+    strings.reset();
+    arena.Reset();
+    strings.emplace(arena);
+}
+
+// Relative outputs are resolved against the compile directory, which under
+// cyclomatic-scan is only the file system's working directory.
+std::string getTranslationUnitKey(CompilerInstance &instance, llvm::StringRef mainFile) {
+    llvm::StringRef key = instance.getFrontendOpts().OutputFile;
+    if (key.empty() || key == "-")
+        key = mainFile;
+    llvm::SmallString<256> absKey(key);
+    instance.getFileManager().makeAbsolutePath(absKey);
+    llvm::sys::path::remove_dots(absKey, /*remove_dot_dot=*/true);
+    return std::string(absKey);
+}
+
+// The shard is named after the translation unit key. The hash keeps equal
+// basenames from different directories apart.
+static std::string getShardPath(CompilerInstance &instance, llvm::StringRef outputDir, llvm::StringRef mainFile,
+                                llvm::StringRef extension) {
+    std::string key = getTranslationUnitKey(instance, mainFile);
+    llvm::SmallString<256> shard(outputDir);
+    llvm::sys::path::append(shard, llvm::sys::path::filename(key) + "-" +
+                                       llvm::utohexstr(llvm::xxHash64(key), /*LowerCase=*/true) + extension);
+    return std::string(shard);
+}
+
+// Shards are streamed into a temporary file and renamed into place once
+// complete, so concurrent compiler jobs never observe a torn shard.
+ComplexityResultHandler makeShardWriter(std::string outputDir, ResultsFormat format) {
+    llvm::StringRef extension = format == ResultsFormat::Binary ? ".cyb" : ".cy";
+    // std::function must be copyable, so the open file lives behind a shared_ptr.
+    auto writer = std::make_shared<AtomicFileWriter>();
+    return [outputDir = std::move(outputDir), extension, writer](CompilerInstance &instance, llvm::StringRef mainFile,
+                                                                 llvm::StringRef results, bool last) {
+        std::string shard = getShardPath(instance, outputDir, mainFile, extension);
+        llvm::Error err = llvm::Error::success();
+        if (!writer->isOpen())
+            err = writer->open(shard);
+        if (!err) {
+            writer->stream() << results;
+            if (last)
+                err = writer->commit();
+        }
+        if (err) {
+            auto &d = instance.getDiagnostics();
+            unsigned id = d.getCustomDiagID(DiagnosticsEngine::Warning, "cannot write cyclomatic complexity results to '%0': %1");
+            d.Report(id) << shard << llvm::toString(std::move(err));
+        }
+    };
+}
+
+CyclomaticComplexityConsumer::CyclomaticComplexityConsumer(CompilerInstance& instance, CyclomaticComplexityOptions options,
+                                                           ComplexityResultHandler handler)
+    : instance(instance), options(std::move(options)),
+      timers(instance.getCodeGenOpts().TimePasses ? std::make_unique<ComplexityTimers>() : nullptr),
+      visitor(&instance.getASTContext(), instance.getDiagnostics(), this->options,
+              [this](llvm::StringRef mainFile, llvm::StringRef chunk, bool last) {
+                  this->handler(this->instance, mainFile, chunk, last);
+              },
+              timers ? &timers->metrics : nullptr),
+      handler(std::move(handler)) {
+    auto &sm = instance.getSourceManager();
+    if (auto entry = sm.getFileEntryRefForID(sm.getMainFileID()))
+        this->options.unitKey = getTranslationUnitKey(instance, entry->getName());
+}
+
+// Declarations are handed over as soon as the parser has finished them, so
+// their bodies are walked while still in cache. Inline member functions come
+// separately, once the class around them is complete.
+bool CyclomaticComplexityConsumer::HandleTopLevelDecl(DeclGroupRef group) {
+    if (options.incremental) {
+        for (Decl *decl : group)
+            visitor.TraverseDecl(decl);
     }
+    return true;
+}
 
-    virtual PluginASTAction::ActionType getActionType() override {
-        return PluginASTAction::AddAfterMainAction;
+void CyclomaticComplexityConsumer::HandleInlineFunctionDefinition(FunctionDecl *func) {
+    if (options.incremental)
+        visitor.TraverseDecl(func);
+}
+
+// Lists the statements of every kind for the -ftime-trace counters event.
+static std::string getStatementKindDetail(const StatementHistogram &statements) {
+    std::string detail;
+    for (unsigned kind = 0; kind < StatementKindCount; ++kind) {
+        detail += kind == 0 ? " (" : ", ";
+        detail += getStatementKindName(static_cast<StatementKind>(kind));
+        detail += ": " + std::to_string(statements.counts[kind]);
     }
-};
+    return detail + ")";
+}
+
+// In incremental mode the traversal only picks up what the parser did not
+// hand over, such as implicit instantiations and late-parsed templates.
+void CyclomaticComplexityConsumer::HandleTranslationUnit(ASTContext &context) {
+    auto &sm = context.getSourceManager();
+    llvm::StringRef mainFile;
+    if (auto entry = sm.getFileEntryRefForID(sm.getMainFileID()))
+        mainFile = entry->getName();
 
-static FrontendPluginRegistry::Add<CyclomaticComplexityAction> X("cyclomatic-complexity", "Calculate cyclomatic complexity of functions");
+    llvm::TimeTraceScope scope("CyclomaticComplexity", mainFile);
+    {
+        llvm::TimeTraceScope traversalScope("CyclomaticComplexityTraversal");
+        llvm::TimeRegion region(timers ? &timers->traversal : nullptr);
+        visitor.TraverseDecl(context.getTranslationUnitDecl());
+        visitor.analyzePending();
+        visitor.reportSummary();
+    }
+    {
+        llvm::TimeTraceScope outputScope("CyclomaticComplexityOutput");
+        llvm::TimeRegion region(timers ? &timers->output : nullptr);
+        visitor.flushResults(/*last=*/true);
+    }
+
+    // -ftime-trace has no counter events, so the totals are the detail of an
+    // empty event at the end of the translation unit.
+    if (llvm::timeTraceProfilerEnabled()) {
+        ComplexityCounters counters = visitor.getCounters();
+        llvm::TimeTraceScope countersScope("CyclomaticComplexityCounters", [&] {
+            return "functions visited: " + std::to_string(counters.functionsVisited) +
+                   ", header functions skipped: " + std::to_string(counters.headerFunctionsSkipped) +
+                   ", functions reused: " + std::to_string(counters.functionsReused) +
+                   ", gate violations: " + std::to_string(counters.gateViolations) +
+                   ", statements walked: " + std::to_string(counters.statements.total()) +
+                   getStatementKindDetail(counters.statements) +
+                   ", bytes written: " + std::to_string(counters.bytesWritten);
+        });
+    }
+}
 
 /* 
 This main body of the code is responsible for the following:
 - Traversing the AST and calculating the cyclomatic complexity of each function
 - Reporting the cyclomatic complexity as a remark
-- Writing the cyclomatic complexity of each function to a file
+- Streaming the cyclomatic complexity of each function to a per-translation-unit shard file in fixed-size chunks
 
 Cyclomatic complexity is a software metric used to indicate the complexity of a program. It is a quantitative measure of the number of linearly independent paths through a program's source code. It is calculated by counting the number of decision points in the source code. The higher the cyclomatic complexity, the more complex the program is.
 
 The CyclomaticComplexityVisitor class is a RecursiveASTVisitor that traverses the AST and calculates the cyclomatic complexity of each function. 
-The VisitFunctionDecl method is called for each function declaration in the AST. 
-The calculateCyclomaticComplexity method calculates the cyclomatic complexity of a function by counting the number of branching statements in the function's body.
-The countBranchingStatements method recursively counts the branching statements in a statement.
+The TraverseDecl method is called for each declaration in the AST and hands every function definition to calculateComplexity instead of descending into its body.
+The calculateComplexity method computes the McCabe, extended McCabe and cognitive complexity of a function's body in a single pass with an explicit work stack, so deeply nested code cannot overflow the native stack. Every statement is dispatched once on its statement class.
+Lambdas, blocks and local classes are not descended into; they are reported as entities of their own.
 
 This code was extensively written with pain and suffering by
 - Krishnatejaswi S
@@ -0,0 +1,155 @@
+#include "ComplexityCache.h"
+#include "CyclomaticComplexity.h"
+
+#include "clang/Frontend/FrontendPluginRegistry.h"
+#include "llvm/Support/CommandLine.h"
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+using namespace clang;
+
+// clang asks a fresh plugin instance for its action type before ParseArgs
+// runs, so this has to be an LLVM option (-mllvm) rather than a plugin arg.
+static llvm::cl::opt<bool> AnalysisOnly(
+    "cyclomatic-analysis-only",
+    llvm::cl::desc("Run the cyclomatic complexity analysis instead of code generation"),
+    llvm::cl::init(false));
+
+class CyclomaticComplexityAction : public PluginASTAction {
+    // Every translation unit writes its own shard into this directory; use
+    // cyclomatic-merge to combine them into a single report.
+    std::string outputDir = "results.cy.d";
+    CyclomaticComplexityOptions options;
+    std::optional<ComplexityCache> cache;
+    bool replayed = false;
+    std::string diffPath;
+    std::string diffRoot = ".";
+
+protected:
+    virtual std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance& instance, llvm::StringRef file) override {
+        ComplexityResultHandler handler = makeShardWriter(outputDir, options.format);
+        // Results restricted to a change are partial, so they are neither
+        // replayed nor stored.
+        if (!cache || options.changedLines)
+            return std::make_unique<CyclomaticComplexityConsumer>(instance, options, std::move(handler));
+
+        // On a hit the shard is written right away and nothing is analyzed.
+        // Gates need the analysis, so they are never answered from the cache.
+        if (options.gates.empty() && cache->replay(instance, file, handler, options.headerIndex.get())) {
+            replayed = true;
+            return std::make_unique<ASTConsumer>();
+        }
+        CyclomaticComplexityOptions tuOptions = options;
+        ComplexityResultHandler store = cache->storeResults(std::move(handler), tuOptions);
+        return std::make_unique<CyclomaticComplexityConsumer>(instance, std::move(tuOptions), std::move(store));
+    }
+
+    // Only reached in analysis-only mode, where the plugin is the main action:
+    // a cache hit then skips parsing altogether.
+    virtual void ExecuteAction() override {
+        if (!replayed)
+            PluginASTAction::ExecuteAction();
+    }
+
+    virtual bool ParseArgs(const CompilerInstance& instance, const std::vector<std::string>& args) override {
+        auto &d = instance.getDiagnostics();
+        for (llvm::StringRef arg : args) {
+            if (arg.consume_front("output-dir=")) {
+                outputDir = arg.str();
+            } else if (arg.consume_front("cache-dir=")) {
+                // The cc1 command line already covers every plugin argument.
+                cache.emplace(arg.str(), "");
+            } else if (arg.consume_front("header-index=")) {
+                // Shared by every compiler job of the build.
+                options.headerIndex = std::make_shared<DirectoryHeaderIndex>(arg.str());
+            } else if (arg == "format=text" || arg == "format=binary") {
+                options.format = arg == "format=binary" ? ResultsFormat::Binary : ResultsFormat::Text;
+            } else if (arg == "remarks=all" || arg == "remarks=summary" || arg == "remarks=none") {
+                using RemarkMode = CyclomaticComplexityOptions::RemarkMode;
+                options.remarks = arg == "remarks=all" ? RemarkMode::All
+                                  : arg == "remarks=summary" ? RemarkMode::Summary
+                                                             : RemarkMode::None;
+            } else if (arg == "metric=mccabe" || arg == "metric=extended" || arg == "metric=cognitive") {
+                options.metric = arg == "metric=mccabe"     ? ComplexityMetric::McCabe
+                                 : arg == "metric=extended" ? ComplexityMetric::ExtendedMcCabe
+                                                            : ComplexityMetric::Cognitive;
+            } else if (arg.consume_front("remark-threshold=")) {
+                if (arg.getAsInteger(10, options.remarkThreshold)) {
+                    unsigned id = d.getCustomDiagID(DiagnosticsEngine::Error, "invalid remark threshold '%0'");
+                    d.Report(id) << arg;
+                    return false;
+                }
+            } else if (arg.consume_front("cfg-threshold=")) {
+                unsigned threshold;
+                if (arg.getAsInteger(10, threshold)) {
+                    unsigned id = d.getCustomDiagID(DiagnosticsEngine::Error, "invalid CFG threshold '%0'");
+                    d.Report(id) << arg;
+                    return false;
+                }
+                options.cfgThreshold = threshold;
+            } else if (arg.consume_front("threads=")) {
+                if (arg.getAsInteger(10, options.threads)) {
+                    unsigned id = d.getCustomDiagID(DiagnosticsEngine::Error, "invalid thread count '%0'");
+                    d.Report(id) << arg;
+                    return false;
+                }
+            } else if (arg.consume_front("chunk-records=")) {
+                if (arg.getAsInteger(10, options.chunkRecords) || options.chunkRecords == 0) {
+                    unsigned id = d.getCustomDiagID(DiagnosticsEngine::Error, "invalid chunk size '%0'");
+                    d.Report(id) << arg;
+                    return false;
+                }
+            } else if (arg.consume_front("gate=")) {
+                auto rule = CyclomaticComplexityOptions::parseGateRule(arg);
+                if (!rule) {
+                    unsigned id = d.getCustomDiagID(DiagnosticsEngine::Error, "invalid gate '%0': %1");
+                    d.Report(id) << arg << llvm::toString(rule.takeError());
+                    return false;
+                }
+                options.gates.push_back(std::move(*rule));
+            } else if (arg.consume_front("diff=")) {
+                diffPath = arg.str();
+            } else if (arg.consume_front("diff-root=")) {
+                diffRoot = arg.str();
+            } else if (arg == "incremental") {
+                options.incremental = true;
+            } else if (arg == "template-instantiations") {
+                options.templateInstantiations = true;
+            } else if (arg.starts_with("include=") || arg.starts_with("exclude=")) {
+                auto &globs = arg.starts_with("include=") ? options.includeGlobs : options.excludeGlobs;
+                auto glob = llvm::GlobPattern::create(arg.drop_front(8));
+                if (!glob) {
+                    unsigned id = d.getCustomDiagID(DiagnosticsEngine::Error, "invalid path glob '%0': %1");
+                    d.Report(id) << arg.drop_front(8) << llvm::toString(glob.takeError());
+                    return false;
+                }
+                globs.push_back(std::move(*glob));
+            } else {
+                unsigned id = d.getCustomDiagID(DiagnosticsEngine::Error, "invalid argument '%0' to cyclomatic-complexity plugin");
+                d.Report(id) << arg;
+                return false;
+            }
+        }
+        if (!diffPath.empty()) {
+            auto changes = ChangedLines::load(diffPath, diffRoot);
+            if (!changes) {
+                unsigned id = d.getCustomDiagID(DiagnosticsEngine::Error, "invalid diff '%0': %1");
+                d.Report(id) << diffPath << llvm::toString(changes.takeError());
+                return false;
+            }
+            options.changedLines = std::make_shared<const ChangedLines>(std::move(*changes));
+        }
+        return true;
+    }
+
+    // In analysis-only mode the plugin replaces the main action, so clang
+    // stops after Sema and no IR or object file is produced.
+    virtual PluginASTAction::ActionType getActionType() override {
+        return AnalysisOnly ? PluginASTAction::ReplaceAction : PluginASTAction::AddAfterMainAction;
+    }
+};
+
+static FrontendPluginRegistry::Add<CyclomaticComplexityAction> X("cyclomatic-complexity", "Calculate cyclomatic complexity of functions");
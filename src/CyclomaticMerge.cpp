@@ -0,0 +1,249 @@
+#include "ComplexityIndex.h"
+#include "ComplexityResults.h"
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <vector>
+
+using namespace llvm;
+
+static cl::list<std::string> Inputs(cl::Positional, cl::desc("<shard directory or results file>..."), cl::OneOrMore);
+static cl::opt<std::string> OutputFile("o", cl::desc("Output report (binary if it ends in .cyb)"), cl::value_desc("file"),
+                                       cl::init("results.cy"));
+static cl::opt<std::string> IndexFile("index",
+                                      cl::desc("Also write an index of all shards for cyclomatic-query. "
+                                               "Without -o only the index is written, and shards unchanged since "
+                                               "the previous index are not read again"),
+                                      cl::value_desc("file.cyi"));
+static cl::opt<unsigned> Jobs("j", cl::desc("Number of reader threads (0 = all cores)"), cl::init(0));
+
+static void collectShards(StringRef input, std::vector<std::string> &shards) {
+    if (!sys::fs::is_directory(input)) {
+        shards.push_back(input.str());
+        return;
+    }
+    std::error_code ec;
+    for (sys::fs::directory_iterator it(input, ec), end; it != end && !ec; it.increment(ec)) {
+        StringRef extension = sys::path::extension(it->path());
+        if (extension == ".cy" || extension == ".cyb")
+            shards.push_back(it->path());
+    }
+    if (ec)
+        errs() << "cyclomatic-merge: cannot read '" << input << "': " << ec.message() << "\n";
+}
+
+namespace {
+
+// The units of a shard, text or binary. The file stays loaded (a binary one
+// mapped) so the units can be regrouped without copying the strings.
+struct LoadedShard {
+    bool ok = false;
+    std::unique_ptr<MemoryBuffer> text;
+    std::optional<ComplexityResultsFile> binary;
+    std::vector<ParsedResultsUnit> units;
+};
+
+static LoadedShard loadFailed(StringRef shard, const Twine &reason) {
+    errs() << "cyclomatic-merge: cannot read '" << shard << "': " << reason << "\n";
+    return LoadedShard();
+}
+
+// What identifies a shard in the index.
+struct ShardStamp {
+    uint64_t size = 0;
+    int64_t mtime = 0;
+};
+
+} // namespace
+
+static std::optional<ShardStamp> getShardStamp(StringRef shard) {
+    sys::fs::file_status status;
+    if (sys::fs::status(shard, status))
+        return std::nullopt;
+    auto mtime = status.getLastModificationTime().time_since_epoch();
+    return ShardStamp{status.getSize(), std::chrono::duration_cast<std::chrono::nanoseconds>(mtime).count()};
+}
+
+static bool byIdentity(const FunctionResult &lhs, const FunctionResult &rhs) {
+    return std::tie(lhs.name, lhs.file, lhs.line) < std::tie(rhs.name, rhs.file, rhs.line);
+}
+
+static LoadedShard loadShard(StringRef shard) {
+    LoadedShard loaded;
+    if (sys::path::extension(shard) != ".cyb") {
+        auto buffer = MemoryBuffer::getFile(shard, /*IsText=*/true, /*RequiresNullTerminator=*/false);
+        if (!buffer)
+            return loadFailed(shard, buffer.getError().message());
+        loaded.text = std::move(*buffer);
+        auto units = parseTextResults(loaded.text->getBuffer());
+        if (!units)
+            return loadFailed(shard, toString(units.takeError()));
+        loaded.units = std::move(*units);
+        loaded.ok = true;
+        return loaded;
+    }
+
+    auto file = ComplexityResultsFile::open(shard);
+    if (!file)
+        return loadFailed(shard, toString(file.takeError()));
+    loaded.binary.emplace(std::move(*file));
+    for (const auto &unit : loaded.binary->getUnits()) {
+        ParsedResultsUnit &parsed = loaded.units.emplace_back();
+        parsed.mainFile = unit.getMainFile();
+        parsed.key = unit.getKey();
+        for (size_t i = 0; i < unit.size(); ++i)
+            parsed.results.push_back(unit[i]);
+    }
+    loaded.ok = true;
+    return loaded;
+}
+
+int main(int argc, char **argv) {
+    cl::ParseCommandLineOptions(argc, argv, "Merge per-translation-unit cyclomatic complexity shards\n");
+
+    std::vector<std::string> shards;
+    for (const auto &input : Inputs)
+        collectShards(input, shards);
+    // Directory iteration order is unspecified; sort so the report is reproducible.
+    std::sort(shards.begin(), shards.end());
+
+    // An index-only run takes the functions of shards that are unchanged
+    // since the previous index from there instead of reading them.
+    bool writeReport = IndexFile.empty() || OutputFile.getNumOccurrences();
+    bool indexed = !IndexFile.empty();
+    std::optional<ComplexityIndex> previous;
+    StringMap<size_t> previousSources;
+    if (!writeReport && sys::fs::exists(IndexFile)) {
+        auto index = ComplexityIndex::open(IndexFile);
+        if (index) {
+            previous.emplace(std::move(*index));
+            for (size_t i = 0; i < previous->getSourceCount(); ++i)
+                previousSources[previous->getSource(i).path] = i;
+        } else {
+            errs() << "cyclomatic-merge: rebuilding '" << IndexFile << "': " << toString(index.takeError()) << "\n";
+        }
+    }
+
+    std::vector<std::optional<ShardStamp>> stamps(shards.size());
+    std::vector<std::optional<size_t>> reused(shards.size());
+    if (indexed) {
+        for (size_t i = 0; i < shards.size(); ++i) {
+            stamps[i] = getShardStamp(shards[i]);
+            auto it = previousSources.find(shards[i]);
+            if (!stamps[i] || it == previousSources.end())
+                continue;
+            ComplexityIndex::Source source = previous->getSource(it->second);
+            if (source.size == stamps[i]->size && source.mtime == stamps[i]->mtime)
+                reused[i] = it->second;
+        }
+    }
+
+    // Every shard is loaded by a worker into its own slot, so no state is
+    // shared between workers.
+    bool binaryOutput = writeReport && sys::path::extension(OutputFile) == ".cyb";
+    ThreadPool pool(hardware_concurrency(Jobs));
+    std::vector<std::shared_future<LoadedShard>> pending(shards.size());
+    for (size_t i = 0; i < shards.size(); ++i) {
+        if (reused[i])
+            continue;
+        const std::string &shard = shards[i];
+        pending[i] = pool.async([&shard]() { return loadShard(shard); });
+    }
+
+    bool failed = false;
+    std::vector<const LoadedShard *> loaded(shards.size(), nullptr);
+    for (size_t i = 0; i < shards.size(); ++i) {
+        if (!pending[i].valid())
+            continue;
+        const LoadedShard &shard = pending[i].get();
+        if (shard.ok)
+            loaded[i] = &shard;
+        else
+            failed = true;
+    }
+
+    // Translation units are streamed in chunks, and chunks of concurrent TUs
+    // may interleave in one file. Units of both formats are therefore
+    // regrouped by their key, which tells compilations of the same main file
+    // apart, and sorted. That gives every TU the same order regardless of how
+    // its results were chunked.
+    if (writeReport) {
+        struct MergedUnit {
+            StringRef mainFile;
+            std::vector<FunctionResult> records;
+        };
+        std::map<StringRef, MergedUnit> units;
+        Error err = writeToOutput(OutputFile, [&](raw_ostream &out) {
+            for (const LoadedShard *shard : loaded) {
+                if (!shard)
+                    continue;
+                for (const ParsedResultsUnit &unit : shard->units) {
+                    MergedUnit &merged = units[unit.key];
+                    merged.mainFile = unit.mainFile;
+                    llvm::append_range(merged.records, unit.results);
+                }
+            }
+
+            for (auto &[key, unit] : units) {
+                llvm::sort(unit.records, byIdentity);
+                if (binaryOutput)
+                    writeBinaryResults(out, unit.mainFile, key, unit.records);
+                else
+                    printResults(out, unit.mainFile, key, unit.records);
+            }
+            return Error::success();
+        });
+        if (err) {
+            errs() << "cyclomatic-merge: cannot write '" << OutputFile << "': " << toString(std::move(err)) << "\n";
+            return 1;
+        }
+    }
+
+    // Shards that could not be read are left out, so the next update reads
+    // them again.
+    if (indexed) {
+        std::vector<IndexSourceInput> sources;
+        for (size_t i = 0; i < shards.size(); ++i) {
+            if (!stamps[i] || (!reused[i] && !loaded[i]))
+                continue;
+            IndexSourceInput source{shards[i], stamps[i]->size, stamps[i]->mtime, {}};
+            if (reused[i]) {
+                ComplexityIndex::Source old = previous->getSource(*reused[i]);
+                for (size_t j = 0; j < old.functionCount; ++j)
+                    source.functions.push_back(previous->getFunction(old.firstFunction + j));
+            } else {
+                for (const ParsedResultsUnit &unit : loaded[i]->units)
+                    llvm::append_range(source.functions, unit.results);
+                llvm::sort(source.functions, byIdentity);
+            }
+            sources.push_back(std::move(source));
+        }
+        Error err = writeToOutput(IndexFile, [&](raw_ostream &out) {
+            writeComplexityIndex(out, sources);
+            return Error::success();
+        });
+        if (err) {
+            errs() << "cyclomatic-merge: cannot write '" << IndexFile << "': " << toString(std::move(err)) << "\n";
+            return 1;
+        }
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,124 @@
+#include "ComplexityIndex.h"
+#include "ComplexityResults.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <string>
+
+using namespace llvm;
+
+static cl::opt<std::string> IndexFile(cl::Positional, cl::desc("<index.cyi>"), cl::Required);
+static cl::opt<ComplexityMetric> Metric(
+    "metric", cl::desc("Metric to rank and summarize by"), cl::init(ComplexityMetric::McCabe),
+    cl::values(clEnumValN(ComplexityMetric::McCabe, "mccabe", "Cyclomatic complexity"),
+               clEnumValN(ComplexityMetric::ExtendedMcCabe, "extended", "Cyclomatic complexity with && and ||"),
+               clEnumValN(ComplexityMetric::Cognitive, "cognitive", "Cognitive complexity")));
+static cl::opt<unsigned> Top("top", cl::desc("Print the N most complex functions"), cl::value_desc("N"), cl::init(0));
+static cl::opt<std::string> Under("under", cl::desc("Only consider functions in files below this directory"),
+                                  cl::value_desc("dir"));
+static cl::opt<bool> Histogram("histogram", cl::desc("Print how many functions of the whole index have each score"));
+static cl::opt<bool> Rollup("rollup", cl::desc("Print totals per directory"));
+static cl::opt<unsigned> Depth("depth", cl::desc("Directory levels below --under that --rollup prints"),
+                               cl::init(1));
+
+static bool isUnder(StringRef path, StringRef dir) {
+    if (dir.empty() || path == dir)
+        return true;
+    if (!path.consume_front(dir))
+        return false;
+    return dir.ends_with("/") || path.starts_with("/");
+}
+
+static unsigned getDepth(StringRef path) {
+    unsigned depth = 0;
+    StringRef relative = sys::path::relative_path(path, sys::path::Style::posix);
+    for (auto it = sys::path::begin(relative, sys::path::Style::posix), end = sys::path::end(relative); it != end; ++it)
+        ++depth;
+    return depth;
+}
+
+static void printTop(const ComplexityIndex &index, StringRef under) {
+    unsigned printed = 0;
+    for (uint32_t function : index.getRanking(Metric)) {
+        if (printed == Top)
+            break;
+        FunctionResult result = index.getFunction(function);
+        if (!isUnder(result.file, under))
+            continue;
+        outs() << format("%8u  ", result.scores[Metric]) << result.name << "  " << result.file << ":" << result.line
+               << "\n";
+        ++printed;
+    }
+}
+
+static void printHistogram(const ComplexityIndex &index) {
+    auto buckets = index.getHistogram(Metric);
+    for (size_t value = 0; value < buckets.size(); ++value) {
+        if (buckets[value] == 0)
+            continue;
+        bool last = value + 1 == buckets.size();
+        outs() << format_decimal(value, 7) << (last ? "+" : " ") << format("  %u\n", uint32_t(buckets[value]));
+    }
+}
+
+static void printRollup(const ComplexityIndex &index, StringRef under) {
+    unsigned metric = static_cast<unsigned>(Metric.getValue());
+    unsigned baseDepth = getDepth(under);
+    outs() << " functions       max         total      mean  directory\n";
+    for (size_t i = 0; i < index.getDirectoryCount(); ++i) {
+        ComplexityIndex::Directory directory = index.getDirectory(i);
+        if (!isUnder(directory.path, under) || getDepth(directory.path) > baseDepth + Depth)
+            continue;
+        // "" only matches when the whole build is asked for.
+        if (directory.path.empty() && !under.empty())
+            continue;
+        double mean = double(directory.totalScores[metric]) / directory.functionCount;
+        outs() << format("%10u  %8u  %12llu  %8.2f  ", directory.functionCount, directory.maxScores.values[metric],
+                         (unsigned long long)directory.totalScores[metric], mean)
+               << (directory.path.empty() ? StringRef("<all>") : directory.path) << "\n";
+    }
+}
+
+int main(int argc, char **argv) {
+    cl::ParseCommandLineOptions(argc, argv, "Query an index written by cyclomatic-merge --index\n");
+
+    auto index = ComplexityIndex::open(IndexFile);
+    if (!index) {
+        errs() << "cyclomatic-query: cannot read '" << IndexFile << "': " << toString(index.takeError()) << "\n";
+        return 1;
+    }
+
+    // Directories are stored absolute and normalized, so --under is too.
+    std::string under;
+    if (!Under.empty()) {
+        SmallString<256> path(Under);
+        sys::fs::make_absolute(path);
+        under = normalizeIndexPath(path);
+    }
+    if (!under.empty() && !index->findDirectory(under)) {
+        errs() << "cyclomatic-query: no functions below '" << under << "'\n";
+        return 1;
+    }
+
+    // Without a query, the whole build is summarized.
+    bool summary = !Top && !Histogram && !Rollup;
+    if (summary) {
+        ComplexityIndex::Directory all = index->findDirectory(under).value_or(ComplexityIndex::Directory{});
+        unsigned metric = static_cast<unsigned>(Metric.getValue());
+        outs() << "Functions: " << all.functionCount << ", " << getMetricName(Metric)
+               << ": max " << all.maxScores.values[metric] << ", total " << all.totalScores[metric] << "\n";
+    }
+    if (Top)
+        printTop(*index, under);
+    if (Histogram)
+        printHistogram(*index);
+    if (Rollup)
+        printRollup(*index, under);
+    return 0;
+}
@@ -0,0 +1,613 @@
+#include "AtomicFileWriter.h"
+#include "ComplexityCache.h"
+#include "CyclomaticComplexity.h"
+#include "SharedFileCache.h"
+
+#include "clang/Frontend/FrontendAction.h"
+#include "clang/Tooling/CompilationDatabase.h"
+#include "clang/Tooling/Tooling.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/ScopeExit.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <vector>
+
+using namespace clang;
+using namespace clang::tooling;
+
+static llvm::cl::OptionCategory ScanCategory("cyclomatic-scan options");
+static llvm::cl::opt<std::string> BuildPath("p", llvm::cl::desc("Directory containing compile_commands.json"),
+                                            llvm::cl::value_desc("build-dir"), llvm::cl::init("."),
+                                            llvm::cl::cat(ScanCategory));
+static llvm::cl::opt<std::string> OutputFile("o", llvm::cl::desc("Output report"), llvm::cl::value_desc("file"),
+                                             llvm::cl::init("results.cy"), llvm::cl::cat(ScanCategory));
+static llvm::cl::opt<ResultsFormat> Format("format", llvm::cl::desc("Report format"), llvm::cl::init(ResultsFormat::Text),
+                                           llvm::cl::values(clEnumValN(ResultsFormat::Text, "text", "results.cy text"),
+                                                            clEnumValN(ResultsFormat::Binary, "binary",
+                                                                       "Binary results readable with ComplexityResultsFile")),
+                                           llvm::cl::cat(ScanCategory));
+static llvm::cl::opt<CyclomaticComplexityOptions::RemarkMode> Remarks(
+    "remarks", llvm::cl::desc("Remarks printed while scanning"), llvm::cl::init(CyclomaticComplexityOptions::RemarkMode::None),
+    llvm::cl::values(clEnumValN(CyclomaticComplexityOptions::RemarkMode::All, "all", "One remark per function"),
+                     clEnumValN(CyclomaticComplexityOptions::RemarkMode::Summary, "summary", "One remark per translation unit"),
+                     clEnumValN(CyclomaticComplexityOptions::RemarkMode::None, "none", "No remarks")),
+    llvm::cl::cat(ScanCategory));
+static llvm::cl::opt<ComplexityMetric> Metric(
+    "metric", llvm::cl::desc("Metric reported by remarks and compared to --remark-threshold"),
+    llvm::cl::init(ComplexityMetric::McCabe),
+    llvm::cl::values(clEnumValN(ComplexityMetric::McCabe, "mccabe", "McCabe cyclomatic complexity"),
+                     clEnumValN(ComplexityMetric::ExtendedMcCabe, "extended", "McCabe plus && and ||"),
+                     clEnumValN(ComplexityMetric::Cognitive, "cognitive", "Cognitive complexity")),
+    llvm::cl::cat(ScanCategory));
+static llvm::cl::opt<unsigned> RemarkThreshold("remark-threshold",
+                                               llvm::cl::desc("Only report functions above this complexity"),
+                                               llvm::cl::init(0), llvm::cl::cat(ScanCategory));
+static llvm::cl::opt<bool> TemplateInstantiations("template-instantiations",
+                                                  llvm::cl::desc("Also measure template instantiations"),
+                                                  llvm::cl::cat(ScanCategory));
+static llvm::cl::opt<unsigned> CFGThreshold("cfg-threshold",
+                                            llvm::cl::desc("Compute McCabe from the CFG for functions above this estimate"),
+                                            llvm::cl::value_desc("N"), llvm::cl::cat(ScanCategory));
+static llvm::cl::opt<unsigned> ChunkRecords("chunk-records",
+                                            llvm::cl::desc("Functions buffered per TU before results are written"),
+                                            llvm::cl::init(4096), llvm::cl::cat(ScanCategory));
+static llvm::cl::opt<bool> Incremental("incremental", llvm::cl::desc("Measure functions while the TU is parsed"),
+                                       llvm::cl::cat(ScanCategory));
+static llvm::cl::opt<std::string> CacheDir("cache-dir", llvm::cl::desc("Reuse results of unchanged translation units"),
+                                           llvm::cl::value_desc("dir"), llvm::cl::cat(ScanCategory));
+static llvm::cl::opt<std::string> HeaderIndexDir("header-index",
+                                                 llvm::cl::desc("Share claimed header functions with other scans"),
+                                                 llvm::cl::value_desc("dir"), llvm::cl::cat(ScanCategory));
+static llvm::cl::list<std::string> IncludeGlobs("include", llvm::cl::desc("Only measure files matching this glob"),
+                                                llvm::cl::value_desc("glob"), llvm::cl::cat(ScanCategory));
+static llvm::cl::list<std::string> ExcludeGlobs("exclude", llvm::cl::desc("Do not measure files matching this glob"),
+                                                llvm::cl::value_desc("glob"), llvm::cl::cat(ScanCategory));
+static llvm::cl::opt<unsigned> Jobs("j", llvm::cl::desc("Number of worker threads (0 = all cores)"),
+                                    llvm::cl::init(0), llvm::cl::cat(ScanCategory));
+static llvm::cl::opt<unsigned> ShardIndex("shard-index", llvm::cl::desc("Part of the database this scan covers"),
+                                          llvm::cl::init(0), llvm::cl::cat(ScanCategory));
+static llvm::cl::opt<unsigned> ShardCount("shard-count",
+                                          llvm::cl::desc("Number of parts the database is split into across machines"),
+                                          llvm::cl::init(1), llvm::cl::cat(ScanCategory));
+static llvm::cl::opt<unsigned> MemoryBudgetMB(
+    "memory-budget", llvm::cl::desc("Only start translation units while their expected memory fits (0 = no limit)"),
+    llvm::cl::value_desc("MiB"), llvm::cl::init(0), llvm::cl::cat(ScanCategory));
+static llvm::cl::list<std::string> Gates("gate",
+                                         llvm::cl::desc("Fail on functions whose --metric is above N, in files "
+                                                        "matching the glob if one is given"),
+                                         llvm::cl::value_desc("[glob:]N"), llvm::cl::cat(ScanCategory));
+static llvm::cl::opt<unsigned> MaxViolations("max-violations",
+                                             llvm::cl::desc("Stop starting translation units after this many gate "
+                                                            "violations (0 = scan everything)"),
+                                             llvm::cl::init(0), llvm::cl::cat(ScanCategory));
+static llvm::cl::opt<std::string> DiffFile("diff",
+                                           llvm::cl::desc("Only measure functions touched by this unified diff or "
+                                                          "list of file:first-last ranges ('-' for stdin)"),
+                                           llvm::cl::value_desc("file"), llvm::cl::cat(ScanCategory));
+static llvm::cl::opt<std::string> DiffRoot("diff-root", llvm::cl::desc("Directory the paths in --diff are relative to"),
+                                           llvm::cl::value_desc("dir"), llvm::cl::init("."), llvm::cl::cat(ScanCategory));
+static llvm::cl::opt<unsigned> FunctionThreads("function-threads",
+                                               llvm::cl::desc("Threads walking the functions of one TU (0 = all cores)"),
+                                               llvm::cl::init(1), llvm::cl::cat(ScanCategory));
+
+// All translation units stream into one report. Results arrive as rendered,
+// self-contained chunks, so the lock is only held while appending one.
+// Chunks of concurrent TUs interleave. Every chunk carries the key of its TU,
+// and cyclomatic-merge puts the chunks of each TU back together.
+class ReportWriter {
+    llvm::raw_fd_ostream &out;
+    std::mutex lock;
+
+public:
+    explicit ReportWriter(llvm::raw_fd_ostream &out) : out(out) {}
+
+    void append(llvm::StringRef results) {
+        std::lock_guard<std::mutex> guard(lock);
+        out << results;
+    }
+};
+
+// What each translation unit cost in earlier scans, kept next to the cache
+// entries: the wall time of its analysis and the memory its AST and
+// preprocessor held at the end. Cache hits keep the costs of the last
+// analysis, so a file that changes again is still known to be expensive.
+struct TUCost {
+    double seconds;
+    uint64_t bytes;
+};
+
+class CostTable {
+    std::mutex lock;
+    llvm::StringMap<TUCost> costs;
+
+public:
+    void load(llvm::StringRef path) {
+        auto buffer = llvm::MemoryBuffer::getFile(path);
+        if (!buffer)
+            return;
+        llvm::SmallVector<llvm::StringRef, 0> lines;
+        (*buffer)->getBuffer().split(lines, '\n', /*MaxSplit=*/-1, /*KeepEmpty=*/false);
+        for (llvm::StringRef line : lines) {
+            auto [micros, rest] = line.split(' ');
+            auto [bytes, file] = rest.split(' ');
+            uint64_t microsValue, bytesValue;
+            if (!micros.getAsInteger(10, microsValue) && !bytes.getAsInteger(10, bytesValue) && !file.empty())
+                costs[file] = {microsValue / 1e6, bytesValue};
+        }
+    }
+
+    void record(llvm::StringRef file, TUCost cost) {
+        std::lock_guard<std::mutex> guard(lock);
+        costs[file] = cost;
+    }
+
+    std::optional<TUCost> lookup(llvm::StringRef file) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = costs.find(file);
+        if (it == costs.end())
+            return std::nullopt;
+        return it->second;
+    }
+
+    llvm::Error save(llvm::StringRef path) {
+        AtomicFileWriter writer;
+        if (llvm::Error err = writer.open(path))
+            return err;
+        for (const auto &entry : costs)
+            writer.stream() << uint64_t(entry.second.seconds * 1e6) << ' ' << entry.second.bytes << ' ' << entry.first() << '\n';
+        return writer.commit();
+    }
+};
+
+// Admits translation units while the memory they are expected to need fits
+// into the budget. One is always admitted when none are running, so a TU
+// larger than the whole budget still gets analyzed, on its own.
+class MemoryBudget {
+    uint64_t budget;
+    uint64_t inUse = 0;
+    std::mutex lock;
+    std::condition_variable released;
+
+public:
+    explicit MemoryBudget(uint64_t budget) : budget(budget) {}
+
+    void acquire(uint64_t bytes) {
+        std::unique_lock<std::mutex> guard(lock);
+        released.wait(guard, [&] { return inUse == 0 || inUse + bytes <= budget; });
+        inUse += bytes;
+    }
+
+    void release(uint64_t bytes) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            inUse -= bytes;
+        }
+        released.notify_all();
+    }
+};
+
+// Returns the translation units of one shard of the database. Every node
+// computes the same split, so the shards cover the database exactly once
+// without any coordination between them.
+//
+// Splits the files so that every shard gets about the same amount of work,
+// estimated by the size of the main file. Round-robin would leave one node
+// with the few huge generated TUs of a tree; instead the largest files are
+// placed first, each on the shard with the least work so far.
+static std::vector<std::string> getShardFiles(std::vector<std::string> allFiles, unsigned index, unsigned count) {
+    struct Job {
+        std::string file;
+        uint64_t cost;
+    };
+    std::vector<Job> jobs;
+    for (std::string &file : allFiles) {
+        uint64_t size = 0;
+        llvm::sys::fs::file_size(file, size);
+        // Unreadable files still cost a compile attempt.
+        jobs.push_back({std::move(file), std::max<uint64_t>(size, 1)});
+    }
+    // Ties are broken by name, so that all nodes agree on the order.
+    std::sort(jobs.begin(), jobs.end(),
+              [](const Job &a, const Job &b) { return std::tie(b.cost, a.file) < std::tie(a.cost, b.file); });
+
+    std::vector<uint64_t> load(count, 0);
+    std::vector<std::string> files;
+    for (Job &job : jobs) {
+        unsigned shard = std::min_element(load.begin(), load.end()) - load.begin();
+        load[shard] += job.cost;
+        if (shard == index)
+            files.push_back(std::move(job.file));
+    }
+    return files;
+}
+
+// Starts the most expensive translation units first, so that the scan does
+// not end with most workers idle while the last few huge ones run. A file
+// with no previous timing is estimated from its size at the rate measured
+// for the others.
+static void scheduleLongestFirst(std::vector<std::string> &files, CostTable &costs) {
+    std::vector<uint64_t> sizes(files.size(), 0);
+    double knownSeconds = 0, knownBytes = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+        llvm::sys::fs::file_size(files[i], sizes[i]);
+        if (auto cost = costs.lookup(files[i])) {
+            knownSeconds += cost->seconds;
+            knownBytes += sizes[i];
+        }
+    }
+    double secondsPerByte = knownBytes > 0 ? knownSeconds / knownBytes : 1;
+
+    std::vector<std::pair<double, std::string>> jobs;
+    for (size_t i = 0; i < files.size(); ++i) {
+        auto cost = costs.lookup(files[i]);
+        jobs.emplace_back(cost ? cost->seconds : sizes[i] * secondsPerByte, std::move(files[i]));
+    }
+    std::stable_sort(jobs.begin(), jobs.end(), [](const auto &a, const auto &b) { return a.first > b.first; });
+    for (size_t i = 0; i < jobs.size(); ++i)
+        files[i] = std::move(jobs[i].second);
+}
+
+static std::string getRealPath(llvm::StringRef path) {
+    llvm::SmallString<256> real;
+    if (llvm::sys::fs::real_path(path, real))
+        return path.str();
+    return std::string(real);
+}
+
+// Without knowing what a TU includes, only a change to nothing but main
+// files of the database narrows the scan down: to those TUs. Any other
+// changed file may be a header of every TU.
+static void keepAffectedFiles(std::vector<std::string> &files, const ChangedLines &changes) {
+    llvm::StringSet<> mainFiles;
+    for (const std::string &file : files)
+        mainFiles.insert(getRealPath(file));
+    for (llvm::StringRef changed : changes.getFiles()) {
+        if (!mainFiles.contains(changed))
+            return;
+    }
+    llvm::erase_if(files, [&](const std::string &file) { return !changes.containsFile(getRealPath(file)); });
+}
+
+// Memory expected for a translation unit the scan has no cost for yet: the
+// average bytes per source byte of those it has, or `fallback` without any.
+static uint64_t estimateMemory(const std::vector<std::string> &files, CostTable &costs, uint64_t fallback) {
+    uint64_t knownBytes = 0, knownSize = 0, unknownSize = 0, unknown = 0;
+    for (const std::string &file : files) {
+        uint64_t size = 0;
+        llvm::sys::fs::file_size(file, size);
+        if (auto cost = costs.lookup(file)) {
+            knownBytes += cost->bytes;
+            knownSize += size;
+        } else {
+            unknownSize += size;
+            ++unknown;
+        }
+    }
+    if (knownSize == 0 || unknown == 0)
+        return fallback;
+    return double(knownBytes) / knownSize * (double(unknownSize) / unknown);
+}
+
+static bool parseGlobs(const llvm::cl::list<std::string> &patterns, std::vector<llvm::GlobPattern> &globs) {
+    for (const auto &pattern : patterns) {
+        auto glob = llvm::GlobPattern::create(pattern);
+        if (!glob) {
+            llvm::errs() << "cyclomatic-scan: invalid glob '" << pattern << "': " << llvm::toString(glob.takeError()) << "\n";
+            return false;
+        }
+        globs.push_back(std::move(*glob));
+    }
+    return true;
+}
+
+// Everything besides the compile command that changes the results of a TU.
+static std::string getCacheSalt() {
+    std::string salt = Format == ResultsFormat::Binary ? "binary" : "text";
+    if (TemplateInstantiations)
+        salt += " template-instantiations";
+    if (CFGThreshold.getNumOccurrences())
+        salt += " cfg-threshold=" + std::to_string(CFGThreshold);
+    for (const auto &glob : IncludeGlobs)
+        salt += " include=" + glob;
+    for (const auto &glob : ExcludeGlobs)
+        salt += " exclude=" + glob;
+    return salt;
+}
+
+// What the analysis of one translation unit reported besides its results.
+struct ScanOutcome {
+    uint64_t violations = 0;
+    // Errors other than gate violations, such as the TU failing to compile.
+    bool otherErrors = false;
+};
+
+class CyclomaticComplexityScanAction : public ASTFrontendAction {
+    ReportWriter &writer;
+    const CyclomaticComplexityOptions &options;
+    const std::optional<ComplexityCache> &cache;
+    CostTable &costs;
+    ScanOutcome &outcome;
+    CyclomaticComplexityConsumer *consumer = nullptr;
+    bool skipped = false;
+
+public:
+    CyclomaticComplexityScanAction(ReportWriter &writer, const CyclomaticComplexityOptions &options,
+                                   const std::optional<ComplexityCache> &cache, CostTable &costs, ScanOutcome &outcome)
+        : writer(writer), options(options), cache(cache), costs(costs), outcome(outcome) {}
+
+protected:
+    std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &instance, llvm::StringRef file) override {
+        ComplexityResultHandler handler = [&writer = writer](CompilerInstance &, llvm::StringRef, llvm::StringRef results,
+                                                             bool) { writer.append(results); };
+        if (options.changedLines) {
+            // Results restricted to a change are partial, so they are neither
+            // replayed nor stored. What the TU read the last time still tells
+            // whether the change can affect it: adding an include changes a
+            // file it read already.
+            if (cache && !isAffected(instance)) {
+                skipped = true;
+                return std::make_unique<ASTConsumer>();
+            }
+        } else if (cache && options.gates.empty() &&
+                   cache->replay(instance, file, handler, options.headerIndex.get())) {
+            // Gates need the analysis, so they are never answered from the cache.
+            skipped = true;
+            return std::make_unique<ASTConsumer>();
+        }
+        CyclomaticComplexityOptions tuOptions = options;
+        if (cache && !options.changedLines)
+            handler = cache->storeResults(std::move(handler), tuOptions);
+        auto result = std::make_unique<CyclomaticComplexityConsumer>(instance, std::move(tuOptions), std::move(handler));
+        consumer = result.get();
+        return result;
+    }
+
+    bool isAffected(CompilerInstance &instance) const {
+        auto deps = cache->getDependencies(instance);
+        if (!deps)
+            return true;
+        for (const std::string &dep : *deps) {
+            llvm::SmallString<256> path(dep);
+            instance.getFileManager().makeAbsolutePath(path);
+            if (options.changedLines->containsFile(getRealPath(path)))
+                return true;
+        }
+        return false;
+    }
+
+    // The consumer is created before the TU is parsed, so a cache hit skips
+    // parsing entirely.
+    void ExecuteAction() override {
+        if (skipped)
+            return;
+        // Gate violations are reported as errors, so they are subtracted to
+        // tell whether anything else went wrong.
+        DiagnosticConsumer &diagnostics = *getCompilerInstance().getDiagnostics().getClient();
+        unsigned errorsBefore = diagnostics.getNumErrors();
+        auto start = std::chrono::steady_clock::now();
+        ASTFrontendAction::ExecuteAction();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        uint64_t violations = consumer ? consumer->getCounters().gateViolations : 0;
+        outcome.violations += violations;
+        if (diagnostics.getNumErrors() - errorsBefore > violations)
+            outcome.otherErrors = true;
+
+        // The AST is still alive here and freed right after; file contents
+        // are left out, since the scan shares them between TUs.
+        CompilerInstance &instance = getCompilerInstance();
+        uint64_t bytes = instance.getSourceManager().getDataStructureSizes();
+        if (instance.hasASTContext()) {
+            ASTContext &context = instance.getASTContext();
+            bytes += context.getASTAllocatedMemory() + context.getSideTableAllocatedMemory();
+        }
+        if (instance.hasPreprocessor())
+            bytes += instance.getPreprocessor().getTotalMemory();
+
+        llvm::SmallString<256> file(getCurrentFile());
+        instance.getFileManager().makeAbsolutePath(file);
+        llvm::sys::path::remove_dots(file, /*remove_dot_dot=*/true);
+        costs.record(file, {elapsed.count(), bytes});
+    }
+};
+
+// Serves a single translation unit; `outcome` receives its gate violations
+// and whether it had other errors.
+class CyclomaticComplexityScanActionFactory : public FrontendActionFactory {
+    ReportWriter &writer;
+    const CyclomaticComplexityOptions &options;
+    const std::optional<ComplexityCache> &cache;
+    CostTable &costs;
+    ScanOutcome &outcome;
+
+public:
+    CyclomaticComplexityScanActionFactory(ReportWriter &writer, const CyclomaticComplexityOptions &options,
+                                          const std::optional<ComplexityCache> &cache, CostTable &costs,
+                                          ScanOutcome &outcome)
+        : writer(writer), options(options), cache(cache), costs(costs), outcome(outcome) {}
+
+    std::unique_ptr<FrontendAction> create() override {
+        return std::make_unique<CyclomaticComplexityScanAction>(writer, options, cache, costs, outcome);
+    }
+};
+
+int main(int argc, char **argv) {
+    llvm::cl::HideUnrelatedOptions(ScanCategory);
+    llvm::cl::ParseCommandLineOptions(argc, argv, "Cyclomatic complexity of every translation unit in a compilation database\n");
+
+    std::string error;
+    auto compilations = CompilationDatabase::autoDetectFromDirectory(BuildPath, error);
+    if (!compilations) {
+        llvm::errs() << "cyclomatic-scan: " << error << "\n";
+        return 1;
+    }
+
+    if (ShardCount == 0 || ShardIndex >= ShardCount) {
+        llvm::errs() << "cyclomatic-scan: --shard-index must be below --shard-count\n";
+        return 1;
+    }
+    // Claims kept in memory only cover this shard, so every shard would
+    // report the header functions its TUs include.
+    if (ShardCount > 1 && HeaderIndexDir.empty()) {
+        llvm::errs() << "cyclomatic-scan: --shard-count needs a --header-index directory shared by all shards\n";
+        return 1;
+    }
+    std::shared_ptr<const ChangedLines> changedLines;
+    if (!DiffFile.empty()) {
+        auto changes = ChangedLines::load(DiffFile, DiffRoot);
+        if (!changes) {
+            llvm::errs() << "cyclomatic-scan: invalid diff '" << DiffFile << "': " << llvm::toString(changes.takeError())
+                         << "\n";
+            return 1;
+        }
+        changedLines = std::make_shared<const ChangedLines>(std::move(*changes));
+    }
+
+    std::vector<std::string> files = compilations->getAllFiles();
+    if (changedLines)
+        keepAffectedFiles(files, *changedLines);
+    if (ShardCount > 1)
+        files = getShardFiles(std::move(files), ShardIndex, ShardCount);
+    // Costs are only kept with a cache, which is what makes runs repeat.
+    CostTable costs;
+    llvm::SmallString<256> costsPath;
+    if (!CacheDir.empty()) {
+        costsPath = CacheDir;
+        llvm::sys::path::append(costsPath, "costs");
+        costs.load(costsPath);
+    }
+    scheduleLongestFirst(files, costs);
+
+    std::error_code ec;
+    llvm::raw_fd_ostream out(OutputFile, ec, Format == ResultsFormat::Text ? llvm::sys::fs::OF_Text : llvm::sys::fs::OF_None);
+    if (ec) {
+        llvm::errs() << "cyclomatic-scan: cannot write '" << OutputFile << "': " << ec.message() << "\n";
+        return 1;
+    }
+
+    // Header functions are measured once per scan by whichever worker reaches
+    // them first, or once across scans sharing --header-index.
+    CyclomaticComplexityOptions options;
+    options.format = Format;
+    options.remarks = Remarks;
+    options.metric = Metric;
+    options.remarkThreshold = RemarkThreshold;
+    options.templateInstantiations = TemplateInstantiations;
+    options.threads = FunctionThreads;
+    options.incremental = Incremental;
+    options.chunkRecords = std::max(1u, unsigned(ChunkRecords));
+    options.changedLines = changedLines;
+    if (CFGThreshold.getNumOccurrences())
+        options.cfgThreshold = CFGThreshold;
+    if (HeaderIndexDir.empty())
+        options.headerIndex = std::make_shared<InProcessHeaderIndex>();
+    else
+        options.headerIndex = std::make_shared<DirectoryHeaderIndex>(HeaderIndexDir);
+    if (!parseGlobs(IncludeGlobs, options.includeGlobs) || !parseGlobs(ExcludeGlobs, options.excludeGlobs))
+        return 1;
+    for (const auto &spec : Gates) {
+        auto rule = CyclomaticComplexityOptions::parseGateRule(spec);
+        if (!rule) {
+            llvm::errs() << "cyclomatic-scan: invalid gate '" << spec << "': " << llvm::toString(rule.takeError()) << "\n";
+            return 1;
+        }
+        options.gates.push_back(std::move(*rule));
+    }
+
+    std::optional<ComplexityCache> cache;
+    if (!CacheDir.empty())
+        cache.emplace(CacheDir, getCacheSalt());
+
+    ReportWriter writer(out);
+    // Files are queued in the order they should start. Every idle worker
+    // takes the next one from the shared queue, so no worker sits on a
+    // backlog while another runs out of work. Each runs its own ClangTool on
+    // its own file system, because the working directory belongs to it, but
+    // all of them share one cache of the headers they read.
+    SharedFileCache fileCache(llvm::StringSet<>(files.begin(), files.end()));
+    std::mutex errorLock;
+    std::vector<std::string> failed;
+    std::atomic<uint64_t> violations = 0;
+    std::atomic<size_t> notStarted = 0;
+    {
+        llvm::ThreadPool pool(llvm::hardware_concurrency(Jobs));
+        std::optional<MemoryBudget> budget;
+        uint64_t defaultBytes = 0;
+        if (MemoryBudgetMB) {
+            budget.emplace(uint64_t(MemoryBudgetMB) << 20);
+            defaultBytes = estimateMemory(files, costs, (uint64_t(MemoryBudgetMB) << 20) / pool.getMaxConcurrency());
+        }
+        for (const std::string &file : files) {
+            pool.async([&, file] {
+                // Once the verdict is known, the rest of the queue drains
+                // without being analyzed.
+                if (MaxViolations && violations >= MaxViolations) {
+                    ++notStarted;
+                    return;
+                }
+                uint64_t bytes = 0;
+                if (budget) {
+                    auto cost = costs.lookup(file);
+                    bytes = cost ? cost->bytes : defaultBytes;
+                    budget->acquire(bytes);
+                }
+                auto release = llvm::make_scope_exit([&] {
+                    if (budget)
+                        budget->release(bytes);
+                });
+                // Waiting for memory can take long enough for other TUs to
+                // reach the limit meanwhile.
+                if (MaxViolations && violations >= MaxViolations) {
+                    ++notStarted;
+                    return;
+                }
+                ClangTool tool(*compilations, {file}, std::make_shared<PCHContainerOperations>(),
+                               llvm::makeIntrusiveRefCnt<SharedCacheFileSystem>(llvm::vfs::createPhysicalFileSystem(),
+                                                                                fileCache));
+                ScanOutcome outcome;
+                CyclomaticComplexityScanActionFactory factory(writer, options, cache, costs, outcome);
+                // Violations make the run fail too. It only counts as a
+                // failure of the TU if that is not all it reported, or if the
+                // action never got to report anything.
+                if (tool.run(&factory) && (outcome.otherErrors || outcome.violations == 0)) {
+                    std::lock_guard<std::mutex> guard(errorLock);
+                    failed.push_back(file);
+                }
+                violations += outcome.violations;
+            });
+        }
+        pool.wait();
+    }
+    // Losing the costs only costs the next scan its schedule.
+    if (!costsPath.empty()) {
+        if (llvm::Error err = costs.save(costsPath))
+            llvm::errs() << "cyclomatic-scan: cannot write '" << costsPath << "': " << llvm::toString(std::move(err)) << "\n";
+    }
+    for (const std::string &file : failed)
+        llvm::errs() << "cyclomatic-scan: failed to analyze '" << file << "'\n";
+    if (violations) {
+        llvm::errs() << "cyclomatic-scan: " << violations << " functions above the gate";
+        if (notStarted)
+            llvm::errs() << "; " << notStarted << " translation units not analyzed";
+        llvm::errs() << "\n";
+    }
+    return failed.empty() && violations == 0 ? 0 : 1;
+}
@@ -0,0 +1,294 @@
+#include "CyclomaticComplexity.h"
+
+#include "clang/Basic/Diagnostic.h"
+#include "clang/Basic/DiagnosticOptions.h"
+#include "clang/Driver/Driver.h"
+#include "clang/Frontend/ASTUnit.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/PCHContainerOperations.h"
+#include "clang/Tooling/CompilationDatabase.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cstdio>
+#include <memory>
+#include <optional>
+#include <string>
+#include <variant>
+#include <vector>
+
+using namespace clang;
+using namespace clang::tooling;
+
+static llvm::cl::OptionCategory ServerCategory("cyclomatic-server options");
+static llvm::cl::opt<std::string> BuildPath("p", llvm::cl::desc("Directory containing compile_commands.json"),
+                                            llvm::cl::value_desc("build-dir"), llvm::cl::cat(ServerCategory));
+static llvm::cl::list<std::string> FallbackFlags("fallback-flag",
+                                                 llvm::cl::desc("Flag for files without a compile command"),
+                                                 llvm::cl::value_desc("flag"), llvm::cl::cat(ServerCategory));
+static llvm::cl::opt<bool> TemplateInstantiations("template-instantiations",
+                                                  llvm::cl::desc("Also measure template instantiations"),
+                                                  llvm::cl::cat(ServerCategory));
+
+// JSON-RPC 2.0 error codes.
+enum ErrorCode { ParseError = -32700, InvalidRequest = -32600, MethodNotFound = -32601, InvalidParams = -32602 };
+
+namespace {
+
+struct RequestError {
+    int code;
+    std::string message;
+};
+
+// An open file: its AST stays loaded so a change only reparses the main
+// file, while the preamble (the includes at its top) is reused as a PCH.
+struct OpenFile {
+    std::unique_ptr<ASTUnit> unit;
+    llvm::json::Array functions;
+};
+
+class Server {
+    std::unique_ptr<CompilationDatabase> compilations;
+    std::shared_ptr<PCHContainerOperations> pchOperations = std::make_shared<PCHContainerOperations>();
+    std::string resourceDir;
+    CyclomaticComplexityOptions options;
+    llvm::StringMap<OpenFile> files;
+
+    std::optional<RequestError> load(llvm::StringRef path, std::optional<llvm::StringRef> contents);
+    llvm::json::Array analyze(ASTUnit &unit);
+
+public:
+    Server(std::unique_ptr<CompilationDatabase> compilations, std::string resourceDir)
+        : compilations(std::move(compilations)), resourceDir(std::move(resourceDir)) {
+        options.format = ResultsFormat::Binary;
+        options.remarks = CyclomaticComplexityOptions::RemarkMode::None;
+        options.templateInstantiations = TemplateInstantiations;
+        // Kept for the lifetime of the server, so an update only walks the
+        // bodies it changed.
+        options.scoreCache = std::make_shared<FunctionScoreCache>();
+    }
+
+    // Returns the result of a request, or the error to answer it with.
+    std::variant<llvm::json::Value, RequestError> handle(llvm::StringRef method, const llvm::json::Object *params);
+};
+
+} // namespace
+
+// Unsaved contents are handed to the ASTUnit as a remapped buffer, which it
+// takes ownership of.
+static std::vector<ASTUnit::RemappedFile> remap(llvm::StringRef path, std::optional<llvm::StringRef> contents) {
+    std::vector<ASTUnit::RemappedFile> remapped;
+    if (contents)
+        remapped.emplace_back(path.str(), llvm::MemoryBuffer::getMemBufferCopy(*contents, path).release());
+    return remapped;
+}
+
+std::optional<RequestError> Server::load(llvm::StringRef path, std::optional<llvm::StringRef> contents) {
+    auto it = files.find(path);
+    if (it != files.end()) {
+        // Reparse returns true on failure; the previous AST is gone then.
+        if (it->second.unit->Reparse(pchOperations, remap(path, contents))) {
+            files.erase(it);
+            return RequestError{InvalidParams, "cannot reparse '" + path.str() + "'"};
+        }
+        it->second.functions = analyze(*it->second.unit);
+        return std::nullopt;
+    }
+
+    std::vector<std::string> command;
+    std::string directory;
+    if (compilations) {
+        std::vector<CompileCommand> commands = compilations->getCompileCommands(path);
+        if (!commands.empty()) {
+            command = commands.front().CommandLine;
+            directory = commands.front().Directory;
+        }
+    }
+    if (command.empty()) {
+        command = {"clang++"};
+        command.insert(command.end(), FallbackFlags.begin(), FallbackFlags.end());
+        command.push_back(path.str());
+    }
+    std::vector<const char *> args;
+    for (const auto &arg : command)
+        args.push_back(arg.c_str());
+
+    IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs = llvm::vfs::createPhysicalFileSystem();
+    if (!directory.empty())
+        fs->setCurrentWorkingDirectory(directory);
+
+    IntrusiveRefCntPtr<DiagnosticsEngine> diags =
+        CompilerInstance::createDiagnostics(new DiagnosticOptions(), new IgnoringDiagConsumer());
+    std::unique_ptr<ASTUnit> unit = ASTUnit::LoadFromCommandLine(
+        args.data(), args.data() + args.size(), pchOperations, diags, resourceDir,
+        /*StorePreamblesInMemory=*/true, /*PreambleStoragePath=*/"", /*OnlyLocalDecls=*/false,
+        CaptureDiagsKind::None, remap(path, contents), /*RemappedFilesKeepOriginalName=*/true,
+        /*PrecompilePreambleAfterNParses=*/1, TU_Complete, /*CacheCodeCompletionResults=*/false,
+        /*IncludeBriefCommentsInCodeCompletion=*/false, /*AllowPCHWithCompilerErrors=*/true,
+        SkipFunctionBodiesScope::None, /*SingleFileParse=*/false, /*UserFilesAreVolatile=*/true,
+        /*ForSerialization=*/false, /*RetainExcludedConditionalBlocks=*/false, /*ModuleFormat=*/std::nullopt,
+        /*ErrAST=*/nullptr, fs);
+    if (!unit)
+        return RequestError{InvalidParams, "cannot parse '" + path.str() + "'"};
+
+    OpenFile &file = files[path];
+    file.functions = analyze(*unit);
+    file.unit = std::move(unit);
+    return std::nullopt;
+}
+
+// Only the visitor runs again; the AST it walks is the one the last parse
+// left behind. Declarations from the preamble are skipped like any PCH.
+llvm::json::Array Server::analyze(ASTUnit &unit) {
+    // Every run starts with no claims, so functions of an open header are
+    // measured too.
+    CyclomaticComplexityOptions runOptions = options;
+    runOptions.headerIndex = std::make_shared<InProcessHeaderIndex>();
+
+    std::string results;
+    CyclomaticComplexityVisitor visitor(&unit.getASTContext(), unit.getDiagnostics(), runOptions,
+                                        [&results](llvm::StringRef, llvm::StringRef chunk, bool) { results += chunk; });
+    visitor.TraverseDecl(unit.getASTContext().getTranslationUnitDecl());
+    visitor.analyzePending();
+    visitor.flushResults(/*last=*/true);
+
+    llvm::json::Array functions;
+    auto file = ComplexityResultsFile::create(llvm::MemoryBuffer::getMemBuffer(results, "", /*RequiresNullTerminator=*/false));
+    if (!file) {
+        llvm::consumeError(file.takeError());
+        return functions;
+    }
+    for (const auto &chunk : file->getUnits()) {
+        for (size_t i = 0; i < chunk.size(); ++i) {
+            FunctionResult result = chunk[i];
+            functions.push_back(llvm::json::Object{
+                {"name", result.name.str()},
+                {"file", result.file.str()},
+                {"line", result.line},
+                {"cyclomatic", result.scores[ComplexityMetric::McCabe]},
+                {"extended", result.scores[ComplexityMetric::ExtendedMcCabe]},
+                {"cognitive", result.scores[ComplexityMetric::Cognitive]},
+            });
+        }
+    }
+    return functions;
+}
+
+std::variant<llvm::json::Value, RequestError> Server::handle(llvm::StringRef method, const llvm::json::Object *params) {
+    std::optional<llvm::StringRef> path = params ? params->getString("file") : std::nullopt;
+    if (method == "cyclomatic/open" || method == "cyclomatic/update") {
+        if (!path)
+            return RequestError{InvalidParams, "missing 'file'"};
+        if (auto error = load(*path, params->getString("contents")))
+            return *error;
+        return llvm::json::Value(llvm::json::Array(files[*path].functions));
+    }
+    if (method == "cyclomatic/query") {
+        auto it = path ? files.find(*path) : files.end();
+        if (it == files.end())
+            return RequestError{InvalidParams, "file is not open"};
+        return llvm::json::Value(llvm::json::Array(it->second.functions));
+    }
+    if (method == "cyclomatic/close") {
+        if (!path)
+            return RequestError{InvalidParams, "missing 'file'"};
+        files.erase(*path);
+        return llvm::json::Value(nullptr);
+    }
+    if (method == "shutdown") {
+        files.clear();
+        return llvm::json::Value(nullptr);
+    }
+    return RequestError{MethodNotFound, "unknown method '" + method.str() + "'"};
+}
+
+// Messages are framed like the Language Server Protocol: a Content-Length
+// header, an empty line and the JSON body.
+static std::optional<std::string> readMessage(std::FILE *in) {
+    size_t length = 0;
+    char line[256];
+    while (std::fgets(line, sizeof(line), in)) {
+        llvm::StringRef header = llvm::StringRef(line).rtrim("\r\n");
+        if (header.empty()) {
+            if (length == 0)
+                continue;
+            std::string body(length, '\0');
+            if (std::fread(body.data(), 1, length, in) != length)
+                return std::nullopt;
+            return body;
+        }
+        if (header.consume_front_insensitive("Content-Length:"))
+            header.trim().getAsInteger(10, length);
+    }
+    return std::nullopt;
+}
+
+static void writeMessage(llvm::raw_ostream &out, llvm::json::Value message) {
+    std::string body;
+    llvm::raw_string_ostream bodyStream(body);
+    bodyStream << message;
+    bodyStream.flush();
+    out << "Content-Length: " << body.size() << "\r\n\r\n" << body;
+    out.flush();
+}
+
+static void writeError(llvm::raw_ostream &out, llvm::json::Value id, const RequestError &error) {
+    writeMessage(out, llvm::json::Object{{"jsonrpc", "2.0"},
+                                         {"id", std::move(id)},
+                                         {"error", llvm::json::Object{{"code", error.code}, {"message", error.message}}}});
+}
+
+// Any function of this binary locates it, and with it clang's resource
+// directory next to it.
+static void locateExecutable() {}
+
+int main(int argc, char **argv) {
+    llvm::cl::HideUnrelatedOptions(ServerCategory);
+    llvm::cl::ParseCommandLineOptions(argc, argv, "Cyclomatic complexity server speaking JSON-RPC on stdin/stdout\n");
+
+    std::unique_ptr<CompilationDatabase> compilations;
+    if (!BuildPath.empty()) {
+        std::string error;
+        compilations = CompilationDatabase::autoDetectFromDirectory(BuildPath, error);
+        if (!compilations) {
+            llvm::errs() << "cyclomatic-server: " << error << "\n";
+            return 1;
+        }
+    }
+    std::string executable = llvm::sys::fs::getMainExecutable(argv[0], reinterpret_cast<void *>(&locateExecutable));
+    Server server(std::move(compilations), driver::Driver::GetResourcesPath(executable));
+
+    // stdout carries the protocol; diagnostics of the analyzed files are dropped.
+    llvm::raw_ostream &out = llvm::outs();
+    while (std::optional<std::string> body = readMessage(stdin)) {
+        llvm::Expected<llvm::json::Value> message = llvm::json::parse(*body);
+        if (!message) {
+            writeError(out, nullptr, {ParseError, llvm::toString(message.takeError())});
+            continue;
+        }
+        const llvm::json::Object *request = message->getAsObject();
+        std::optional<llvm::StringRef> method = request ? request->getString("method") : std::nullopt;
+        const llvm::json::Value *id = request ? request->get("id") : nullptr;
+        if (!method) {
+            writeError(out, id ? *id : nullptr, {InvalidRequest, "missing 'method'"});
+            continue;
+        }
+        if (*method == "exit")
+            break;
+
+        auto result = server.handle(*method, request->getObject("params"));
+        // Notifications (requests without an id) get no answer.
+        if (!id)
+            continue;
+        if (auto *error = std::get_if<RequestError>(&result))
+            writeError(out, *id, *error);
+        else
+            writeMessage(out, llvm::json::Object{{"jsonrpc", "2.0"}, {"id", *id}, {"result", std::get<llvm::json::Value>(result)}});
+    }
+    return 0;
+}
@@ -0,0 +1,14 @@
+#include "FunctionScoreCache.h"
+
+std::optional<ComplexityScores> FunctionScoreCache::lookup(llvm::StringRef usr, uint64_t bodyHash) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = entries.find(usr);
+    if (it == entries.end() || it->second.bodyHash != bodyHash)
+        return std::nullopt;
+    return it->second.scores;
+}
+
+void FunctionScoreCache::store(llvm::StringRef usr, uint64_t bodyHash, const ComplexityScores &scores) {
+    std::lock_guard<std::mutex> guard(lock);
+    entries.insert_or_assign(usr, Entry{bodyHash, scores});
+}
@@ -0,0 +1,58 @@
+#include "HeaderIndex.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/Errc.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/Support/raw_ostream.h"
+
+DirectoryHeaderIndex::DirectoryHeaderIndex(std::string directory) : directory(std::move(directory)) {
+    llvm::sys::fs::create_directories(this->directory);
+}
+
+bool DirectoryHeaderIndex::claim(llvm::StringRef identity, llvm::StringRef owner) {
+    llvm::SmallString<256> path(directory);
+    llvm::sys::path::append(path, llvm::utohexstr(llvm::xxHash64(identity), /*LowerCase=*/true));
+
+    // Most claims are made again by every rebuild, so look before writing.
+    auto isOwner = [&] {
+        auto existing = llvm::MemoryBuffer::getFile(path);
+        return existing && !owner.empty() && (*existing)->getBuffer() == owner;
+    };
+    if (llvm::sys::fs::exists(path))
+        return isOwner();
+
+    // The owner is written to a temporary file first, so nobody ever sees a
+    // claim without it. If the index is unusable, measure the function
+    // rather than lose it.
+    int fd;
+    llvm::SmallString<256> temp;
+    if (llvm::sys::fs::createUniqueFile(path + "-%%%%%%%%.tmp", fd, temp))
+        return true;
+    {
+        llvm::raw_fd_ostream out(fd, /*shouldClose=*/true);
+        out << owner;
+    }
+    std::error_code ec = llvm::sys::fs::create_hard_link(temp, path);
+    llvm::sys::fs::remove(temp);
+    if (ec == llvm::errc::file_exists)
+        return isOwner();
+    return true;
+}
+
+bool InProcessHeaderIndex::claim(llvm::StringRef identity, llvm::StringRef owner) {
+    uint64_t hash = llvm::xxHash64(identity);
+    std::lock_guard<std::mutex> guard(lock);
+    auto [it, inserted] = owners.try_emplace(hash, owner.str());
+    return inserted || (!owner.empty() && it->second == owner);
+}
+
+bool RecordingHeaderIndex::claim(llvm::StringRef identity, llvm::StringRef owner) {
+    if (!index->claim(identity, owner))
+        return false;
+    claims.push_back(identity.str());
+    return true;
+}
@@ -0,0 +1,92 @@
+#include "SharedFileCache.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/Path.h"
+
+namespace {
+
+// Hands out views of a cached buffer under the name it was opened by.
+class CachedFile : public llvm::vfs::File {
+    llvm::vfs::Status fileStatus;
+    std::shared_ptr<llvm::MemoryBuffer> contents;
+
+public:
+    CachedFile(llvm::vfs::Status fileStatus, std::shared_ptr<llvm::MemoryBuffer> contents)
+        : fileStatus(std::move(fileStatus)), contents(std::move(contents)) {}
+
+    llvm::ErrorOr<llvm::vfs::Status> status() override { return fileStatus; }
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> getBuffer(const llvm::Twine &name, int64_t, bool requiresNullTerminator,
+                                                                 bool) override {
+        return llvm::MemoryBuffer::getMemBuffer(contents->getBuffer(), name.str(), requiresNullTerminator);
+    }
+    std::error_code close() override { return {}; }
+};
+
+} // namespace
+
+// Relative paths are resolved against this file system's working directory,
+// so that all threads share one key per file.
+std::optional<std::string> SharedCacheFileSystem::getKey(const llvm::Twine &path) {
+    llvm::SmallString<256> key;
+    path.toVector(key);
+    if (makeAbsolute(key))
+        return std::nullopt;
+    llvm::sys::path::remove_dots(key);
+    return std::string(key);
+}
+
+llvm::ErrorOr<llvm::vfs::Status> SharedCacheFileSystem::status(const llvm::Twine &path) {
+    auto key = getKey(path);
+    if (!key)
+        return ProxyFileSystem::status(path);
+    {
+        std::lock_guard<std::mutex> guard(cache.lock);
+        auto it = cache.entries.find(*key);
+        if (it != cache.entries.end()) {
+            if (!it->second.status)
+                return it->second.status.getError();
+            return llvm::vfs::Status::copyWithNewName(*it->second.status, path.str());
+        }
+    }
+    llvm::ErrorOr<llvm::vfs::Status> result = ProxyFileSystem::status(path);
+    std::lock_guard<std::mutex> guard(cache.lock);
+    cache.entries.try_emplace(*key, SharedFileCache::Entry{result, nullptr});
+    return result;
+}
+
+llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>> SharedCacheFileSystem::openFileForRead(const llvm::Twine &path) {
+    auto key = getKey(path);
+    if (!key)
+        return ProxyFileSystem::openFileForRead(path);
+    {
+        std::lock_guard<std::mutex> guard(cache.lock);
+        if (cache.mainFiles.contains(*key))
+            return ProxyFileSystem::openFileForRead(path);
+        auto it = cache.entries.find(*key);
+        if (it != cache.entries.end()) {
+            if (!it->second.status)
+                return it->second.status.getError();
+            if (it->second.contents)
+                return std::make_unique<CachedFile>(llvm::vfs::Status::copyWithNewName(*it->second.status, path.str()),
+                                                    it->second.contents);
+        }
+    }
+
+    // Read the whole file rather than map it: on a network file system a
+    // mapping faults in every page from the server again.
+    auto file = ProxyFileSystem::openFileForRead(path);
+    if (!file)
+        return file.getError();
+    llvm::ErrorOr<llvm::vfs::Status> fileStatus = (*file)->status();
+    auto buffer = (*file)->getBuffer(path, /*FileSize=*/-1, /*RequiresNullTerminator=*/true, /*IsVolatile=*/true);
+    if (!fileStatus || !buffer)
+        return file;
+    std::shared_ptr<llvm::MemoryBuffer> contents = std::move(*buffer);
+
+    std::lock_guard<std::mutex> guard(cache.lock);
+    SharedFileCache::Entry &entry = cache.entries[*key];
+    entry.status = *fileStatus;
+    if (!entry.contents)
+        entry.contents = std::move(contents);
+    return std::make_unique<CachedFile>(llvm::vfs::Status::copyWithNewName(*fileStatus, path.str()), entry.contents);
+}
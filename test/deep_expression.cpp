@@ -0,0 +1,29 @@
+// Stress input for the branch counter: the macros below expand to a single
+// left-nested chain of 131072 additions, each adding a conditional operator.
+// The resulting AST is far deeper than a recursive walk can handle on an
+// 8 MB stack. Expected: Cyclomatic Complexity: 131073 for deep_expression.
+//
+// clang -fsyntax-only -fplugin=./build/libCyclomaticComplexity.so ./test/deep_expression.cpp
+
+#define TERM0 + (v ? 1 : 0)
+#define TERM1 TERM0 TERM0
+#define TERM2 TERM1 TERM1
+#define TERM3 TERM2 TERM2
+#define TERM4 TERM3 TERM3
+#define TERM5 TERM4 TERM4
+#define TERM6 TERM5 TERM5
+#define TERM7 TERM6 TERM6
+#define TERM8 TERM7 TERM7
+#define TERM9 TERM8 TERM8
+#define TERM10 TERM9 TERM9
+#define TERM11 TERM10 TERM10
+#define TERM12 TERM11 TERM11
+#define TERM13 TERM12 TERM12
+#define TERM14 TERM13 TERM13
+#define TERM15 TERM14 TERM14
+#define TERM16 TERM15 TERM15
+#define TERM17 TERM16 TERM16
+
+int deep_expression(int v) {
+    return 0 TERM17;
+}